@@ -0,0 +1,461 @@
+#ifndef TXTFST_BITMAP_H
+#define TXTFST_BITMAP_H
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <bit>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace txtfst
+{
+  namespace details
+  {
+    // Each container covers 2^16 books, like Roaring. A segment rarely holds
+    // that many books, so bitmap containers are sized to the segment instead.
+    constexpr size_t container_bits = 65536;
+    constexpr size_t container_words = container_bits / 64;
+
+    enum class WordOp
+    {
+      And, Or, AndNot
+    };
+
+    template<WordOp op>
+    void word_op(uint64_t* a, const uint64_t* b, size_t n)
+    {
+      size_t i = 0;
+#ifdef __AVX2__
+      for (; i + 4 <= n; i += 4)
+      {
+        auto va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        auto vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if constexpr (op == WordOp::And) va = _mm256_and_si256(va, vb);
+        else if constexpr (op == WordOp::Or) va = _mm256_or_si256(va, vb);
+        else va = _mm256_andnot_si256(vb, va);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(a + i), va);
+      }
+#endif
+      for (; i < n; ++i)
+      {
+        if constexpr (op == WordOp::And) a[i] &= b[i];
+        else if constexpr (op == WordOp::Or) a[i] |= b[i];
+        else a[i] &= ~b[i];
+      }
+    }
+  }
+
+  enum class ContainerType : uint16_t
+  {
+    Array, Bitmap, Run
+  };
+
+  struct Container
+  {
+    uint16_t key{0};
+    ContainerType type{ContainerType::Array};
+    std::vector<uint16_t> values; // Array: sorted values, Run: (start, length - 1) pairs
+    std::vector<uint64_t> words; // Bitmap
+
+    [[nodiscard]] size_t cardinality() const
+    {
+      switch (type)
+      {
+        case ContainerType::Array:
+          return values.size();
+        case ContainerType::Bitmap:
+        {
+          size_t ret = 0;
+          for (auto&& w : words)
+            ret += std::popcount(w);
+          return ret;
+        }
+        case ContainerType::Run:
+        {
+          size_t ret = 0;
+          for (size_t i = 0; i < values.size(); i += 2)
+            ret += values[i + 1] + 1;
+          return ret;
+        }
+      }
+      return 0;
+    }
+
+    void to_bitmap(size_t nwords)
+    {
+      if (type == ContainerType::Bitmap) return;
+      words.assign(nwords, 0);
+      if (type == ContainerType::Array)
+      {
+        for (auto&& v : values)
+          words[v / 64] |= uint64_t{1} << (v % 64);
+      }
+      else
+      {
+        for (size_t i = 0; i < values.size(); i += 2)
+        {
+          for (size_t v = values[i]; v <= values[i] + values[i + 1]; ++v)
+            words[v / 64] |= uint64_t{1} << (v % 64);
+        }
+      }
+      values.clear();
+      type = ContainerType::Bitmap;
+    }
+
+    void to_array()
+    {
+      if (type == ContainerType::Array) return;
+      std::vector<uint16_t> array;
+      for_each([&array](uint16_t v) { array.emplace_back(v); });
+      values = std::move(array);
+      words.clear();
+      type = ContainerType::Array;
+    }
+
+    // Picks the smallest of the three representations.
+    void optimize(size_t nwords)
+    {
+      size_t card = cardinality();
+      size_t runs = 0;
+      bool in_run = false;
+      uint16_t prev = 0;
+      for_each([&](uint16_t v)
+      {
+        if (!in_run || v != prev + 1)
+          ++runs;
+        in_run = true;
+        prev = v;
+      });
+
+      size_t array_bytes = card * sizeof(uint16_t);
+      size_t bitmap_bytes = nwords * sizeof(uint64_t);
+      size_t run_bytes = runs * 2 * sizeof(uint16_t);
+      if (run_bytes < array_bytes && run_bytes < bitmap_bytes)
+      {
+        std::vector<uint16_t> run;
+        for_each([&run](uint16_t v)
+        {
+          if (!run.empty() && run[run.size() - 2] + run.back() + 1 == v)
+            ++run.back();
+          else
+          {
+            run.emplace_back(v);
+            run.emplace_back(0);
+          }
+        });
+        values = std::move(run);
+        words.clear();
+        type = ContainerType::Run;
+      }
+      else if (bitmap_bytes < array_bytes)
+        to_bitmap(nwords);
+      else
+        to_array();
+    }
+
+    template<typename Fn>
+    void for_each(Fn&& fn) const
+    {
+      switch (type)
+      {
+        case ContainerType::Array:
+          for (auto&& v : values)
+            fn(v);
+          break;
+        case ContainerType::Bitmap:
+          for (size_t i = 0; i < words.size(); ++i)
+          {
+            for (auto w = words[i]; w != 0; w &= w - 1)
+              fn(static_cast<uint16_t>(i * 64 + std::countr_zero(w)));
+          }
+          break;
+        case ContainerType::Run:
+          for (size_t i = 0; i < values.size(); i += 2)
+          {
+            for (size_t v = values[i]; v <= values[i] + values[i + 1]; ++v)
+              fn(static_cast<uint16_t>(v));
+          }
+          break;
+      }
+    }
+
+    [[nodiscard]] bool contains(uint16_t v) const
+    {
+      switch (type)
+      {
+        case ContainerType::Array:
+          return std::ranges::binary_search(values, v);
+        case ContainerType::Bitmap:
+          return v / 64 < words.size() && (words[v / 64] >> (v % 64) & 1) != 0;
+        case ContainerType::Run:
+          for (size_t i = 0; i < values.size() && values[i] <= v; i += 2)
+          {
+            if (v <= values[i] + values[i + 1])
+              return true;
+          }
+          return false;
+      }
+      return false;
+    }
+  };
+
+  // A set of book indices inside a segment, stored as Roaring-style containers.
+  class BookSet
+  {
+    std::vector<Container> containers; // sorted by key
+    size_t universe{0}; // the number of books in the segment
+
+  public:
+    BookSet() = default;
+
+    explicit BookSet(size_t universe_) : universe(universe_)
+    {
+    }
+
+    // `books` must be sorted.
+    template<typename Range>
+    static BookSet from_sorted(const Range& books, size_t universe)
+    {
+      BookSet ret(universe);
+      for (auto&& idx : books)
+      {
+        auto key = static_cast<uint16_t>(idx / details::container_bits);
+        if (ret.containers.empty() || ret.containers.back().key != key)
+          ret.containers.emplace_back(Container{.key = key});
+        ret.containers.back().values.emplace_back(static_cast<uint16_t>(idx % details::container_bits));
+      }
+      for (auto&& c : ret.containers)
+        c.optimize(ret.container_words(c.key));
+      return ret;
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+      size_t ret = 0;
+      for (auto&& c : containers)
+        ret += c.cardinality();
+      return ret;
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+      return containers.empty();
+    }
+
+    [[nodiscard]] bool contains(size_t idx) const
+    {
+      auto key = static_cast<uint16_t>(idx / details::container_bits);
+      auto it = std::ranges::lower_bound(containers, key, std::less{}, [](auto&& c) { return c.key; });
+      return it != containers.end() && it->key == key
+             && it->contains(static_cast<uint16_t>(idx % details::container_bits));
+    }
+
+    template<typename Fn>
+    void for_each(Fn&& fn) const
+    {
+      for (auto&& c : containers)
+      {
+        size_t base = static_cast<size_t>(c.key) * details::container_bits;
+        c.for_each([&fn, base](uint16_t v) { fn(base + v); });
+      }
+    }
+
+    BookSet& operator&=(const BookSet& rhs)
+    {
+      std::vector<Container> ret;
+      auto it = rhs.containers.begin();
+      for (auto&& c : containers)
+      {
+        while (it != rhs.containers.end() && it->key < c.key) ++it;
+        if (it == rhs.containers.end()) break;
+        if (it->key != c.key) continue;
+        if (auto r = intersect(c, *it); r.cardinality() != 0)
+          ret.emplace_back(std::move(r));
+      }
+      containers = std::move(ret);
+      return *this;
+    }
+
+    BookSet& operator|=(const BookSet& rhs)
+    {
+      std::vector<Container> ret;
+      auto a = containers.begin();
+      auto b = rhs.containers.begin();
+      while (a != containers.end() || b != rhs.containers.end())
+      {
+        if (b == rhs.containers.end() || (a != containers.end() && a->key < b->key))
+          ret.emplace_back(std::move(*a++));
+        else if (a == containers.end() || b->key < a->key)
+          ret.emplace_back(*b++);
+        else
+          ret.emplace_back(unite(std::move(*a++), *b++));
+      }
+      containers = std::move(ret);
+      universe = (std::max)(universe, rhs.universe);
+      return *this;
+    }
+
+    // AND NOT
+    BookSet& operator-=(const BookSet& rhs)
+    {
+      std::vector<Container> ret;
+      auto it = rhs.containers.begin();
+      for (auto&& c : containers)
+      {
+        while (it != rhs.containers.end() && it->key < c.key) ++it;
+        if (it == rhs.containers.end() || it->key != c.key)
+          ret.emplace_back(std::move(c));
+        else if (auto r = subtract(c, *it); r.cardinality() != 0)
+          ret.emplace_back(std::move(r));
+      }
+      containers = std::move(ret);
+      return *this;
+    }
+
+    // [u32 containers][u32 universe] followed by {[u16 key][u16 type][u32 count][data]} for each container.
+    void serialize(std::vector<char>& out) const
+    {
+      auto put = [&out](const void* data, size_t size)
+      {
+        out.insert(out.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+      };
+      auto ncontainers = static_cast<uint32_t>(containers.size());
+      auto nuniverse = static_cast<uint32_t>(universe);
+      put(&ncontainers, sizeof(uint32_t));
+      put(&nuniverse, sizeof(uint32_t));
+      for (auto&& c : containers)
+      {
+        auto type = static_cast<uint16_t>(c.type);
+        auto count = static_cast<uint32_t>(c.type == ContainerType::Bitmap ? c.words.size() : c.values.size());
+        put(&c.key, sizeof(uint16_t));
+        put(&type, sizeof(uint16_t));
+        put(&count, sizeof(uint32_t));
+        if (c.type == ContainerType::Bitmap)
+          put(c.words.data(), c.words.size() * sizeof(uint64_t));
+        else
+          put(c.values.data(), c.values.size() * sizeof(uint16_t));
+      }
+    }
+
+    // Reads a set written by `serialize` and advances `data` past it.
+    static BookSet deserialize(const char*& data)
+    {
+      auto get = [&data](void* dest, size_t size)
+      {
+        std::memcpy(dest, data, size);
+        data += size;
+      };
+      uint32_t ncontainers, nuniverse;
+      get(&ncontainers, sizeof(uint32_t));
+      get(&nuniverse, sizeof(uint32_t));
+      BookSet ret(nuniverse);
+      ret.containers.resize(ncontainers);
+      for (auto&& c : ret.containers)
+      {
+        uint16_t type;
+        uint32_t count;
+        get(&c.key, sizeof(uint16_t));
+        get(&type, sizeof(uint16_t));
+        get(&count, sizeof(uint32_t));
+        c.type = static_cast<ContainerType>(type);
+        if (c.type == ContainerType::Bitmap)
+        {
+          c.words.resize(count);
+          get(c.words.data(), count * sizeof(uint64_t));
+        }
+        else
+        {
+          c.values.resize(count);
+          get(c.values.data(), count * sizeof(uint16_t));
+        }
+      }
+      return ret;
+    }
+
+  private:
+    [[nodiscard]] size_t container_words(uint16_t key) const
+    {
+      size_t base = static_cast<size_t>(key) * details::container_bits;
+      if (universe <= base) return 1;
+      return (std::min)(details::container_words, (universe - base + 63) / 64);
+    }
+
+    // Both operands are widened to bitmaps sharing the larger width.
+    static void widen(Container& a, Container& b)
+    {
+      a.to_bitmap(b.type == ContainerType::Bitmap ? b.words.size() : details::container_words);
+      b.to_bitmap(a.words.size());
+      if (a.words.size() < b.words.size())
+        a.words.resize(b.words.size(), 0);
+    }
+
+    Container intersect(const Container& a, const Container& b) const
+    {
+      Container ret{.key = a.key};
+      if (a.type == ContainerType::Array && b.type == ContainerType::Array)
+      {
+        std::ranges::set_intersection(a.values, b.values, std::back_inserter(ret.values));
+        return ret;
+      }
+      if (a.type == ContainerType::Array || b.type == ContainerType::Array)
+      {
+        auto& array = a.type == ContainerType::Array ? a : b;
+        auto& other = a.type == ContainerType::Array ? b : a;
+        for (auto&& v : array.values)
+        {
+          if (other.contains(v))
+            ret.values.emplace_back(v);
+        }
+        return ret;
+      }
+      Container x = a, y = b;
+      widen(x, y);
+      details::word_op<details::WordOp::And>(x.words.data(), y.words.data(), y.words.size());
+      x.words.resize(y.words.size());
+      x.optimize(container_words(a.key));
+      return x;
+    }
+
+    Container unite(Container&& a, const Container& b) const
+    {
+      if (a.type == ContainerType::Array && b.type == ContainerType::Array)
+      {
+        Container ret{.key = a.key};
+        std::ranges::set_union(a.values, b.values, std::back_inserter(ret.values));
+        ret.optimize(container_words(a.key));
+        return ret;
+      }
+      Container y = b;
+      widen(a, y);
+      details::word_op<details::WordOp::Or>(a.words.data(), y.words.data(), y.words.size());
+      a.optimize(container_words(a.key));
+      return std::move(a);
+    }
+
+    Container subtract(Container& a, const Container& b) const
+    {
+      if (a.type == ContainerType::Array)
+      {
+        Container ret{.key = a.key};
+        for (auto&& v : a.values)
+        {
+          if (!b.contains(v))
+            ret.values.emplace_back(v);
+        }
+        return ret;
+      }
+      Container y = b;
+      widen(a, y);
+      details::word_op<details::WordOp::AndNot>(a.words.data(), y.words.data(), y.words.size());
+      a.optimize(container_words(a.key));
+      return std::move(a);
+    }
+  };
+}
+#endif
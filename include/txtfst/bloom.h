@@ -0,0 +1,82 @@
+#ifndef TXTFST_BLOOM_H
+#define TXTFST_BLOOM_H
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace txtfst
+{
+  namespace details
+  {
+    // FNV-1a followed by a murmur3 finalizer, stable across platforms so that
+    // the filter written by txtfst-build can be probed by txtfst-search.
+    inline uint64_t hash_term(std::string_view term)
+    {
+      uint64_t h = 0xcbf29ce484222325ull;
+      for (auto&& ch : term)
+      {
+        h ^= static_cast<unsigned char>(ch);
+        h *= 0x100000001b3ull;
+      }
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdull;
+      h ^= h >> 33;
+      h *= 0xc4ceb9fe1a85ec53ull;
+      h ^= h >> 33;
+      return h;
+    }
+
+    // Every key sets `bloom_probes` bits in a single 64-bit word, so a lookup
+    // touches exactly one word of the filter.
+    constexpr size_t bloom_bits_per_key = 10;
+    constexpr size_t bloom_probes = 4;
+
+    inline uint64_t bloom_mask(uint64_t h)
+    {
+      uint64_t mask = 0;
+      for (size_t i = 0; i < bloom_probes; ++i)
+        mask |= uint64_t{1} << ((h >> (i * 6)) & 63);
+      return mask;
+    }
+
+    inline size_t bloom_word(uint64_t h, size_t nwords)
+    {
+      return static_cast<size_t>(((h >> 32) * static_cast<uint64_t>(nwords)) >> 32);
+    }
+  }
+
+  struct BloomFilter
+  {
+    std::vector<uint64_t> words;
+
+    explicit BloomFilter(size_t nkeys = 0)
+    {
+      words.resize((nkeys * details::bloom_bits_per_key + 63) / 64);
+    }
+
+    void add(std::string_view term)
+    {
+      if (words.empty()) return;
+      auto h = details::hash_term(term);
+      words[details::bloom_word(h, words.size())] |= details::bloom_mask(h);
+    }
+  };
+
+  struct BloomFilterView
+  {
+    const uint64_t* words{nullptr};
+    size_t size{0};
+
+    [[nodiscard]] bool may_contain(std::string_view term) const
+    {
+      if (size == 0) return false;
+      auto h = details::hash_term(term);
+      auto mask = details::bloom_mask(h);
+      return (words[details::bloom_word(h, size)] & mask) == mask;
+    }
+  };
+}
+#endif
@@ -0,0 +1,67 @@
+#ifndef TXTFST_COUNTS_H
+#define TXTFST_COUNTS_H
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+namespace txtfst
+{
+  // The title and content frequency of each distinct term of one book, by
+  // the term's id in a TermArena, so that an IndexBuilder touches every term
+  // once per book rather than once per occurrence. clear() only resets the
+  // terms that were used, so one table can be kept across books without
+  // paying for its capacity each time.
+  class TermCounts
+  {
+    struct Freq
+    {
+      uint32_t title{0};
+      uint32_t content{0};
+    };
+
+    std::vector<Freq> freqs; // by term id
+    std::vector<uint32_t> used; // the ids seen in this book, in the order they were first seen
+
+  public:
+    void add(uint32_t id, bool title)
+    {
+      if (id >= freqs.size())
+        freqs.resize((std::max)(size_t{id} + 1, freqs.size() * 2));
+      auto& freq = freqs[id];
+      if (freq.title == 0 && freq.content == 0)
+        used.emplace_back(id);
+      if (title)
+        ++freq.title;
+      else
+        ++freq.content;
+    }
+
+    void clear()
+    {
+      for (auto id : used)
+        freqs[id] = Freq{};
+      used.clear();
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+      return used.size();
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+      return used.empty();
+    }
+
+    // Calls `f(id, title_freq, content_freq)` for each distinct term.
+    template<typename F>
+    void for_each(F&& f) const
+    {
+      for (auto id : used)
+        f(id, size_t{freqs[id].title}, size_t{freqs[id].content});
+    }
+  };
+}
+#endif
@@ -0,0 +1,148 @@
+#ifndef TXTFST_DICT_H
+#define TXTFST_DICT_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <span>
+
+#include "packme/packme.h"
+#include "fst.h"
+#include "index.h"
+#include "writer.h"
+
+namespace txtfst
+{
+  // Where a token's postings live: the segment's position in the index file
+  // and the entry the segment's own FST would have returned.
+  struct DictionaryEntry
+  {
+    uint32_t segment{0};
+    uint32_t entry{0};
+  };
+
+  struct DictionaryView
+  {
+    CompiledFSTView<uint32_t> fst_view;
+    const uint64_t* jump_table{nullptr};
+    size_t jump_table_size{0};
+    const DictionaryEntry* locations{nullptr};
+    size_t size{0};
+    size_t segments{0};
+    size_t index_size{0};
+
+    explicit DictionaryView(std::string_view data)
+    {
+      uint64_t size;
+      std::memcpy(&size, data.data(), sizeof(uint64_t));
+      auto [ltpos, ltlen, ftpos, ftlen, nsegments, nindex_size]
+          = packme::unpack<std::tuple<size_t, size_t, size_t, size_t, size_t, size_t> >
+          (std::string_view{data.data() + sizeof(uint64_t), size});
+      size_t offset = size + sizeof(uint64_t);
+
+      segments = nsegments;
+      index_size = nindex_size;
+
+      jump_table = reinterpret_cast<const uint64_t*>(data.data() + offset + ltpos);
+      jump_table_size = ltlen;
+      locations = reinterpret_cast<const DictionaryEntry*>(data.data() + offset + ltpos + ltlen * sizeof(uint64_t));
+      this->size = ftpos - ltpos - ltlen * sizeof(uint64_t);
+
+      fst_view.jump_table = reinterpret_cast<const uint64_t*>(data.data() + offset + ftpos);
+      fst_view.jump_table_size = ftlen;
+      fst_view.fst = data.data() + offset + ftpos + ftlen * sizeof(uint64_t);
+      fst_view.fst_size = data.size() - offset - ftpos - ftlen * sizeof(uint64_t);
+    }
+
+    [[nodiscard]] std::span<const DictionaryEntry> find(const std::string& token) const
+    {
+      auto opt = fst_view.get(token);
+      if (!opt.has_value())
+        return {};
+      auto lcurr = locations + jump_table[*opt] / sizeof(DictionaryEntry);
+      size_t llen = 0;
+      if (*opt != jump_table_size - 1)
+        llen = locations + jump_table[*opt + 1] / sizeof(DictionaryEntry) - lcurr;
+      else
+        llen = locations + size / sizeof(DictionaryEntry) - lcurr;
+      return {lcurr, llen};
+    }
+  };
+
+  struct Dictionary
+  {
+    FST<uint32_t> fst; // store the union of all the segments' tokens
+    std::vector<std::vector<DictionaryEntry> > locations; // unique to a token
+    size_t segments{0}; // the number of segments this dictionary covers
+    size_t index_size{0}; // the size of the index file, used to detect a stale dictionary
+
+    [[nodiscard]] std::vector<char> compile() const
+    {
+      std::vector<char> ret;
+
+      std::vector<uint64_t> locations_table;
+      locations_table.resize(locations.size());
+      ret.resize(locations_table.size() * sizeof(uint64_t));
+      size_t offset = ret.size();
+      for (size_t i = 0; i < locations.size(); ++i)
+      {
+        locations_table[i] = ret.size() - offset;
+        ret.resize(ret.size() + locations[i].size() * sizeof(DictionaryEntry));
+        std::memmove(ret.data() + offset + locations_table[i], locations[i].data(),
+                     locations[i].size() * sizeof(DictionaryEntry));
+      }
+      std::memmove(ret.data(), locations_table.data(), locations_table.size() * sizeof(uint64_t));
+
+      size_t fst_table_pos = ret.size();
+      VectorWriter writer{ret};
+      size_t fst_table_size = fst.compile(writer);
+
+      auto packed = packme::pack(std::make_tuple(size_t{0}, locations_table.size(), fst_table_pos,
+                                                 fst_table_size, segments, index_size));
+      size_t packed_size = packed.size();
+
+      std::vector<char> final;
+      final.resize(packed_size + ret.size() + sizeof(uint64_t));
+      std::memmove(final.data(), &packed_size, sizeof(uint64_t));
+      std::memmove(final.data() + sizeof(uint64_t), packed.data(), packed_size);
+      std::memmove(final.data() + sizeof(uint64_t) + packed_size, ret.data(), ret.size());
+      return final;
+    }
+  };
+
+  class DictionaryBuilder
+  {
+    std::map<std::string, std::vector<DictionaryEntry> > unmerged_tokens;
+    size_t segments{0};
+
+  public:
+    // Segments must be added in the order they appear in the index file.
+    DictionaryBuilder& add_segment(const IndexView& segment)
+    {
+      auto curr_segment = static_cast<uint32_t>(segments++);
+      segment.fst_view.for_each([this, curr_segment](const std::string& token, uint32_t entry)
+      {
+        unmerged_tokens[token].emplace_back(curr_segment, entry);
+      });
+      return *this;
+    }
+
+    // The FST is built on up to `jobs` threads.
+    Dictionary build(size_t index_size, size_t jobs = 1)
+    {
+      std::vector<std::string_view> tokens;
+      std::vector<std::vector<DictionaryEntry> > locations;
+      for (auto&& r : unmerged_tokens)
+      {
+        tokens.emplace_back(r.first);
+        locations.emplace_back(std::move(r.second));
+      }
+      auto fst = build_fst<uint32_t>(tokens.size(), [&tokens](size_t i) { return tokens[i]; }, jobs);
+      unmerged_tokens.clear();
+      return Dictionary{std::move(fst), std::move(locations), segments, index_size};
+    }
+  };
+}
+#endif
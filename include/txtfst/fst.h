@@ -8,7 +8,11 @@
 #include <vector>
 #include <unordered_set>
 #include <memory>
+#include <thread>
 #include <cassert>
+#include <cstring>
+#include <utility>
+#include <algorithm>
 #include <sys/stat.h>
 
 #include "packme/packme.h"
@@ -79,7 +83,61 @@ namespace txtfst
       return output;
     }
 
+    // Finds the word whose output is `target`. This only works when outputs
+    // grow with the words in lexicographic order, as the token ordinals
+    // IndexBuilder assigns do.
+    std::optional<std::string> get_word(Output target) const
+    {
+      if (jump_table_size == 0) return std::nullopt;
+      std::string word;
+      Output output = 0;
+      auto curr = get_state(0);
+      while (!(curr.final && output == target))
+      {
+        const typename State<Output>::Arc* next = nullptr;
+        for (auto&& arc : curr.trans)
+        {
+          if (output + arc.output > target) break;
+          next = &arc;
+        }
+        if (next == nullptr)
+          return std::nullopt;
+        word += next->label;
+        output += next->output;
+        curr = get_state(next->id);
+      }
+      return word;
+    }
+
+    [[nodiscard]] State<Output> state(size_t index) const
+    {
+      return get_state(index);
+    }
+
+    // Visits every word with its output in lexicographic order.
+    template<typename Fn>
+    void for_each(Fn&& fn) const
+    {
+      if (jump_table_size == 0) return;
+      std::string word;
+      for_each_from(0, 0, word, fn);
+    }
+
   private:
+    template<typename Fn>
+    void for_each_from(size_t index, Output output, std::string& word, Fn& fn) const
+    {
+      auto curr = get_state(index);
+      if (curr.final)
+        fn(std::as_const(word), output);
+      for (auto&& arc : curr.trans)
+      {
+        word += arc.label;
+        for_each_from(arc.id, output + arc.output, word, fn);
+        word.pop_back();
+      }
+    }
+
     State<Output> get_state(size_t index) const
     {
       assert(fst != nullptr && index < jump_table_size);
@@ -107,6 +165,59 @@ namespace txtfst
   struct FST
   {
     std::vector<State<Output> > states;
+
+    [[nodiscard]] size_t compiled_size() const
+    {
+      size_t ret = states.size() * sizeof(uint64_t);
+      for (const auto& state : states)
+        ret += state_size(state);
+      return ret;
+    }
+
+    // Writes the jump table followed by the states, returns the size of the jump table.
+    template<typename Writer>
+    size_t compile(Writer& writer) const
+    {
+      uint64_t state_offset = 0;
+      for (size_t i = 0; i < states.size(); ++i)
+      {
+        assert(states[i].id == i);
+        writer.write(&state_offset, sizeof(uint64_t));
+        state_offset += state_size(states[i]);
+      }
+      for (const auto& state : states)
+        write_state(writer, state);
+      return states.size();
+    }
+
+    static size_t state_size(const State<Output>& state)
+    {
+      return sizeof(state.id) + sizeof(state.final) + state.trans.size() * sizeof(typename State<Output>::Arc);
+    }
+
+    template<typename Writer>
+    static void write_state(Writer& writer, const State<Output>& state)
+    {
+      writer.write(&state.id, sizeof(state.id));
+      writer.write(&state.final, sizeof(state.final));
+      // The arcs go through zeroed copies, so that their padding is written
+      // as zeros rather than whatever was in memory, and the same words
+      // always give the same bytes.
+      using Arc = typename State<Output>::Arc;
+      Arc arcs[64];
+      for (size_t first = 0; first < state.trans.size(); first += std::size(arcs))
+      {
+        size_t n = (std::min)(std::size(arcs), state.trans.size() - first);
+        std::memset(static_cast<void*>(arcs), 0, n * sizeof(Arc));
+        for (size_t i = 0; i < n; ++i)
+        {
+          arcs[i].label = state.trans[first + i].label;
+          arcs[i].id = state.trans[first + i].id;
+          arcs[i].output = state.trans[first + i].output;
+        }
+        writer.write(arcs, n * sizeof(Arc));
+      }
+    }
   };
 
   template<std::integral Output>
@@ -129,7 +240,7 @@ namespace txtfst
     });
     using state_eq = decltype([](auto&& a, auto&& b) -> size_t { return a->trans == b->trans; });
     size_t next_state_id;
-    std::string prev_word;
+    std::string_view prev_word;
     std::unordered_set<StatePtr, state_hash, state_eq> freezed;
     std::vector<StatePtr> frontier;
 
@@ -139,7 +250,9 @@ namespace txtfst
       frontier.emplace_back(std::make_shared<State<Output> >(State<Output>{.id = next_state_id++}));
     }
 
-    AddRet add(const std::string& word, Output output)
+    // The builder keeps a view of `word`, which must stay valid until the
+    // next call to add() or build().
+    AddRet add(std::string_view word, Output output)
     {
       if (word.empty()) return AddRet::EmptyWord;
       if (word == prev_word) return AddRet::DuplicateWord;
@@ -261,5 +374,145 @@ namespace txtfst
     //   }
     // }
   };
+
+  namespace details
+  {
+    // Joins FSTs whose roots have no labels in common under one root. Each
+    // part's root is dropped and its other states are renumbered after those
+    // of the parts before it.
+    template<std::integral Output>
+    FST<Output> join_fsts(std::vector<FST<Output> >& parts)
+    {
+      FST<Output> joined;
+      joined.states.emplace_back(State<Output>{.id = 0});
+      for (auto&& part : parts)
+      {
+        // A part's own states start at 1, as only its root is 0.
+        size_t shift = joined.states.size() - 1;
+        for (auto arc : part.states[0].trans)
+        {
+          arc.id += shift;
+          joined.states[0].trans.emplace_back(arc);
+        }
+        for (size_t i = 1; i < part.states.size(); ++i)
+        {
+          auto& state = joined.states.emplace_back(std::move(part.states[i]));
+          state.id += shift;
+          for (auto&& arc : state.trans)
+            arc.id += shift;
+        }
+      }
+      return joined;
+    }
+
+    // Merges the states with the same arcs to the same states, children
+    // first, as FSTBuilder does while it builds. Each part of a joined FST is
+    // already minimal on its own, so only the states the parts have in
+    // common, mostly the ends of common suffixes, are merged here. The root
+    // stays state 0.
+    template<std::integral Output>
+    FST<Output> merge_equivalent_states(const FST<Output>& fst)
+    {
+      constexpr size_t unvisited = static_cast<size_t>(-1);
+      FST<Output> ret;
+      ret.states.emplace_back();
+      auto hash = [&ret](size_t id)
+      {
+        auto& state = ret.states[id];
+        size_t h = state.final;
+        for (auto&& arc : state.trans)
+        {
+          h = (h ^ static_cast<unsigned char>(arc.label)) * 0x100000001B3ull;
+          h = (h ^ arc.id) * 0x100000001B3ull;
+          h = (h ^ static_cast<size_t>(arc.output)) * 0x100000001B3ull;
+        }
+        return h;
+      };
+      auto eq = [&ret](size_t a, size_t b)
+      {
+        return ret.states[a].final == ret.states[b].final && ret.states[a].trans == ret.states[b].trans;
+      };
+      std::unordered_set<size_t, decltype(hash), decltype(eq)> registered(fst.states.size(), hash, eq);
+
+      std::vector<size_t> merged(fst.states.size(), unvisited);
+      std::vector<std::pair<size_t, size_t> > stack{{0, 0}}; // state, next arc
+      while (!stack.empty())
+      {
+        auto [id, next_arc] = stack.back();
+        auto& state = fst.states[id];
+        if (next_arc < state.trans.size())
+        {
+          ++stack.back().second;
+          if (auto child = state.trans[next_arc].id; merged[child] == unvisited)
+            stack.emplace_back(child, 0);
+          continue;
+        }
+        stack.pop_back();
+
+        State<Output> copy{.final = state.final, .trans = state.trans};
+        for (auto&& arc : copy.trans)
+          arc.id = merged[arc.id];
+        if (id == 0)
+        {
+          ret.states[0] = std::move(copy);
+          merged[0] = 0;
+          continue;
+        }
+        copy.id = ret.states.size();
+        ret.states.emplace_back(std::move(copy));
+        auto [it, inserted] = registered.emplace(ret.states.size() - 1);
+        if (!inserted)
+          ret.states.pop_back();
+        merged[id] = *it;
+      }
+      return ret;
+    }
+  }
+
+  // Builds the FST of `count` distinct words in lexicographic order, where
+  // `word(i)` is the i-th word and maps to `i`. The words are split at
+  // changes of their first byte into up to `jobs` ranges of about the same
+  // size, each built by an FSTBuilder on a thread of its own. The parts are
+  // then joined under one root and their common states merged, which gives
+  // the same minimal FST as a single FSTBuilder, up to the order of its
+  // states. The words must stay valid until this returns.
+  template<std::integral Output, typename Word>
+  FST<Output> build_fst(size_t count, Word&& word, size_t jobs = 1)
+  {
+    constexpr size_t min_words_per_part = 4096;
+    size_t parts = std::clamp(count / min_words_per_part, size_t{1}, (std::max)(jobs, size_t{1}));
+    std::vector<std::pair<size_t, size_t> > ranges;
+    for (size_t part = 1, first = 0; part <= parts && first < count; ++part)
+    {
+      size_t last = count;
+      if (part != parts)
+      {
+        last = (std::max)(first + 1, count / parts * part);
+        while (last < count && word(last)[0] == word(last - 1)[0])
+          ++last;
+      }
+      ranges.emplace_back(first, last);
+      first = last;
+    }
+
+    auto build_range = [&word](size_t first, size_t last)
+    {
+      FSTBuilder<Output> builder;
+      for (size_t i = first; i < last; ++i)
+        builder.add(word(i), static_cast<Output>(i));
+      return builder.build();
+    };
+    if (ranges.size() <= 1)
+      return build_range(0, count);
+
+    std::vector<FST<Output> > fsts(ranges.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < ranges.size(); ++i)
+      workers.emplace_back([&, i] { fsts[i] = build_range(ranges[i].first, ranges[i].second); });
+    fsts[0] = build_range(ranges[0].first, ranges[0].second);
+    for (auto&& worker : workers)
+      worker.join();
+    return details::merge_equivalent_states(details::join_fsts(fsts));
+  }
 }
 #endif
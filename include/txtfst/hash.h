@@ -0,0 +1,163 @@
+#ifndef TXTFST_HASH_H
+#define TXTFST_HASH_H
+#pragma once
+
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <bit>
+#include <algorithm>
+
+namespace txtfst
+{
+  namespace details
+  {
+    constexpr uint64_t xxh_prime1 = 11400714785074694791ull;
+    constexpr uint64_t xxh_prime2 = 14029467366897019727ull;
+    constexpr uint64_t xxh_prime3 = 1609587929392839161ull;
+    constexpr uint64_t xxh_prime4 = 9650029242287828579ull;
+    constexpr uint64_t xxh_prime5 = 2870177450012600261ull;
+
+    inline uint64_t xxh_read64(const char* p)
+    {
+      uint64_t v;
+      std::memcpy(&v, p, sizeof(uint64_t));
+      return v;
+    }
+
+    inline uint32_t xxh_read32(const char* p)
+    {
+      uint32_t v;
+      std::memcpy(&v, p, sizeof(uint32_t));
+      return v;
+    }
+
+    inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+    {
+      acc += input * xxh_prime2;
+      acc = std::rotl(acc, 31);
+      return acc * xxh_prime1;
+    }
+
+    inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+    {
+      acc ^= xxh_round(0, val);
+      return acc * xxh_prime1 + xxh_prime4;
+    }
+
+    inline void xxh_stripe(uint64_t (&v)[4], const char* p)
+    {
+      v[0] = xxh_round(v[0], xxh_read64(p));
+      v[1] = xxh_round(v[1], xxh_read64(p + 8));
+      v[2] = xxh_round(v[2], xxh_read64(p + 16));
+      v[3] = xxh_round(v[3], xxh_read64(p + 24));
+    }
+
+    inline uint64_t xxh_converge(const uint64_t (&v)[4])
+    {
+      uint64_t h = std::rotl(v[0], 1) + std::rotl(v[1], 7) + std::rotl(v[2], 12) + std::rotl(v[3], 18);
+      h = xxh_merge(h, v[0]);
+      h = xxh_merge(h, v[1]);
+      h = xxh_merge(h, v[2]);
+      h = xxh_merge(h, v[3]);
+      return h;
+    }
+
+    // Mixes in the last bytes, fewer than a stripe, and the length.
+    inline uint64_t xxh_finish(uint64_t h, uint64_t total, const char* p, const char* end)
+    {
+      h += total;
+      for (; end - p >= 8; p += 8)
+      {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = std::rotl(h, 27) * xxh_prime1 + xxh_prime4;
+      }
+      if (end - p >= 4)
+      {
+        h ^= static_cast<uint64_t>(xxh_read32(p)) * xxh_prime1;
+        h = std::rotl(h, 23) * xxh_prime2 + xxh_prime3;
+        p += 4;
+      }
+      for (; p < end; ++p)
+      {
+        h ^= static_cast<unsigned char>(*p) * xxh_prime5;
+        h = std::rotl(h, 11) * xxh_prime1;
+      }
+
+      h ^= h >> 33;
+      h *= xxh_prime2;
+      h ^= h >> 29;
+      h *= xxh_prime3;
+      h ^= h >> 32;
+      return h;
+    }
+  }
+
+  // XXH64 of `data`, used to tell whether a book's content has changed
+  // since it was indexed.
+  inline uint64_t xxh64(std::string_view data, uint64_t seed = 0)
+  {
+    using namespace details;
+    auto p = data.data();
+    auto end = p + data.size();
+    uint64_t h;
+
+    if (data.size() >= 32)
+    {
+      uint64_t v[4]{seed + xxh_prime1 + xxh_prime2, seed + xxh_prime2, seed, seed - xxh_prime1};
+      for (; end - p >= 32; p += 32)
+        xxh_stripe(v, p);
+      h = xxh_converge(v);
+    }
+    else
+      h = seed + xxh_prime5;
+    return xxh_finish(h, data.size(), p, end);
+  }
+
+  // The same hash over data that arrives in pieces.
+  class Xxh64
+  {
+    uint64_t seed;
+    uint64_t v[4];
+    uint64_t total{0};
+    char pending[32]{};
+    size_t pending_size{0};
+
+  public:
+    explicit Xxh64(uint64_t seed_ = 0)
+      : seed(seed_), v{seed_ + details::xxh_prime1 + details::xxh_prime2, seed_ + details::xxh_prime2, seed_,
+                       seed_ - details::xxh_prime1}
+    {
+    }
+
+    void update(std::string_view data)
+    {
+      if (data.empty()) return;
+      auto p = data.data();
+      auto end = p + data.size();
+      total += data.size();
+      if (pending_size != 0)
+      {
+        size_t n = (std::min)(sizeof(pending) - pending_size, data.size());
+        std::memcpy(pending + pending_size, p, n);
+        pending_size += n;
+        p += n;
+        if (pending_size < sizeof(pending))
+          return;
+        details::xxh_stripe(v, pending);
+        pending_size = 0;
+      }
+      for (; end - p >= 32; p += 32)
+        details::xxh_stripe(v, p);
+      pending_size = end - p;
+      std::memcpy(pending, p, pending_size);
+    }
+
+    [[nodiscard]] uint64_t digest() const
+    {
+      uint64_t h = total >= 32 ? details::xxh_converge(v) : seed + details::xxh_prime5;
+      return details::xxh_finish(h, total, pending, pending + pending_size);
+    }
+  };
+}
+#endif
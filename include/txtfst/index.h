@@ -7,12 +7,37 @@
 #include <ranges>
 #include <algorithm>
 #include <map>
+#include <span>
+#include <functional>
+#include <thread>
+#include <atomic>
 
 #include "packme/packme.h"
 #include "fst.h"
+#include "bloom.h"
+#include "bitmap.h"
+#include "writer.h"
+#include "counts.h"
+#include "intern.h"
 
 namespace txtfst
 {
+  namespace details
+  {
+    // Tokens appearing in at least 1/dense_posting_ratio of a segment's books
+    // also get their title and content book sets stored as containers.
+    constexpr size_t dense_posting_ratio = 16;
+
+    constexpr size_t gram_size = 3;
+
+    inline uint32_t trigram(const char* p)
+    {
+      return static_cast<uint32_t>(static_cast<unsigned char>(p[0])) << 16
+             | static_cast<uint32_t>(static_cast<unsigned char>(p[1])) << 8
+             | static_cast<uint32_t>(static_cast<unsigned char>(p[2]));
+    }
+  }
+
   struct BookEntry
   {
     size_t idx{0};
@@ -20,6 +45,35 @@ namespace txtfst
     size_t content_freq{0};
   };
 
+  // Which frequency a token's postings are sorted by, in decreasing order.
+  enum class ImpactOrder : uint8_t
+  {
+    None, Title, Content
+  };
+
+  struct ScoredBook
+  {
+    size_t freq{0};
+    size_t idx{0};
+  };
+
+  // What a book looked like when it was indexed, so that an update can
+  // tell whether it has changed.
+  struct BookMeta
+  {
+    uint64_t size{0};
+    int64_t mtime{0}; // in nanoseconds
+    uint64_t hash{0};
+  };
+
+  // A token of a book and how often it appears there.
+  struct TokenFreq
+  {
+    std::string token;
+    size_t title_freq{0};
+    size_t content_freq{0};
+  };
+
   struct Entry
   {
     std::vector<BookEntry> books;
@@ -48,22 +102,69 @@ namespace txtfst
     size_t size{};
   };
 
+  struct CompiledSetsView
+  {
+    const uint32_t* entries{nullptr}; // sorted
+    const uint64_t* jump_table{nullptr};
+    size_t jump_table_size{};
+    const char* sets{nullptr};
+  };
+
+  struct CompiledGramsView
+  {
+    const uint32_t* grams{nullptr}; // sorted
+    const uint64_t* jump_table{nullptr};
+    size_t jump_table_size{};
+    const uint32_t* entries{nullptr};
+    size_t size{};
+  };
+
+  // Bytes taken by each part of a segment, for introspection.
+  struct SectionSizes
+  {
+    size_t header{0};
+    size_t filter{0};
+    size_t names{0};
+    size_t paths{0};
+    size_t entries{0};
+    size_t fst{0};
+    size_t sets{0};
+    size_t grams{0};
+    size_t meta{0};
+  };
+
   struct IndexView
   {
     CompiledFSTView<uint32_t> fst_view;
     CompiledEntriesView entries_view;
     CompiledPathsView paths_view;
     CompiledNamesView names_view;
+    CompiledSetsView sets_view;
+    CompiledGramsView grams_view;
+    const BookMeta* meta_view{nullptr};
+    BloomFilterView filter_view;
+    std::string min_term;
+    std::string max_term;
+    ImpactOrder impact{ImpactOrder::None};
+    SectionSizes section_sizes;
 
     explicit IndexView(std::string_view data)
     {
       uint64_t size;
       std::memcpy(&size, data.data(), sizeof(uint64_t));
-      auto [ntpos, ntlen, ptpos, ptlen, etpos, etlen, ftpos, ftlen]
-          = packme::unpack<std::tuple<size_t, size_t, size_t, size_t, size_t, size_t, size_t, size_t> >
+      auto [ntpos, ntlen, ptpos, ptlen, etpos, etlen, ftpos, ftlen, bfpos, bflen, stpos, stlen, gtpos, gtlen,
+        mtpos, order, minterm, maxterm]
+          = packme::unpack<std::tuple<size_t, size_t, size_t, size_t, size_t, size_t, size_t, size_t,
+            size_t, size_t, size_t, size_t, size_t, size_t, size_t, ImpactOrder, std::string, std::string> >
           (std::string_view{data.data() + sizeof(uint64_t), size});
       size_t offset = size + sizeof(uint64_t);
 
+      min_term = std::move(minterm);
+      max_term = std::move(maxterm);
+      impact = order;
+      filter_view.words = reinterpret_cast<const uint64_t*>(data.data() + offset + bfpos);
+      filter_view.size = bflen;
+
       names_view.jump_table = reinterpret_cast<const uint64_t*>(data.data() + offset + ntpos);
       names_view.jump_table_size = ntlen;
       names_view.names = const_cast<char*>(data.data() + offset + ntpos + ntlen * sizeof(uint64_t));
@@ -81,7 +182,41 @@ namespace txtfst
       fst_view.jump_table = reinterpret_cast<const uint64_t*>(data.data() + offset + ftpos);
       fst_view.jump_table_size = ftlen;
       fst_view.fst = data.data() + offset + ftpos + ftlen * sizeof(uint64_t);
-      fst_view.fst_size = data.size() - offset - ftpos - ftlen * sizeof(uint64_t);
+      fst_view.fst_size = stpos - ftpos - ftlen * sizeof(uint64_t);
+
+      sets_view.entries = reinterpret_cast<const uint32_t*>(data.data() + offset + stpos);
+      sets_view.jump_table = reinterpret_cast<const uint64_t*>(data.data() + offset + stpos + stlen * sizeof(uint32_t));
+      sets_view.jump_table_size = stlen;
+      sets_view.sets = data.data() + offset + stpos + stlen * (sizeof(uint32_t) + sizeof(uint64_t));
+
+      grams_view.grams = reinterpret_cast<const uint32_t*>(data.data() + offset + gtpos);
+      grams_view.jump_table = reinterpret_cast<const uint64_t*>(data.data() + offset + gtpos + gtlen * sizeof(uint32_t));
+      grams_view.jump_table_size = gtlen;
+      grams_view.entries = reinterpret_cast<const uint32_t*>(data.data() + offset + gtpos
+                                                             + gtlen * (sizeof(uint32_t) + sizeof(uint64_t)));
+      grams_view.size = mtpos - gtpos - gtlen * (sizeof(uint32_t) + sizeof(uint64_t));
+
+      meta_view = reinterpret_cast<const BookMeta*>(data.data() + offset + mtpos);
+
+      section_sizes = {
+        .header = offset, .filter = bflen * sizeof(uint64_t), .names = ptpos - ntpos, .paths = etpos - ptpos,
+        .entries = ftpos - etpos, .fst = stpos - ftpos, .sets = gtpos - stpos, .grams = mtpos - gtpos,
+        .meta = data.size() - offset - mtpos
+      };
+    }
+
+    [[nodiscard]] size_t books() const
+    {
+      return paths_view.jump_table_size;
+    }
+
+    // Checks the term range and the Bloom filter, both of which live next to
+    // the header, so segments that cannot contain `token` never touch the FST.
+    [[nodiscard]] bool may_contain(const std::string& token) const
+    {
+      if (token < min_term || token > max_term)
+        return false;
+      return filter_view.may_contain(token);
     }
 
     [[nodiscard]] std::vector<std::string> search_title(const std::string& token) const
@@ -94,53 +229,303 @@ namespace txtfst
       return search(token, [](auto&& r) { return r.content_freq; });
     }
 
+    // The books containing `token`, for boolean queries.
+    [[nodiscard]] BookSet title_set(const std::string& token) const
+    {
+      return book_set(token, true);
+    }
+
+    [[nodiscard]] BookSet content_set(const std::string& token) const
+    {
+      return book_set(token, false);
+    }
+
+    // The `k` books in which `token` is most frequent and more frequent than
+    // `threshold`, in decreasing order of frequency.
+    [[nodiscard]] std::vector<ScoredBook> top_title(const std::string& token, size_t k, size_t threshold = 0) const
+    {
+      if (!may_contain(token)) return {};
+      auto opt = fst_view.get(token);
+      if (!opt.has_value()) return {};
+      return top_title_entry(*opt, k, threshold);
+    }
+
+    [[nodiscard]] std::vector<ScoredBook> top_content(const std::string& token, size_t k, size_t threshold = 0) const
+    {
+      if (!may_contain(token)) return {};
+      auto opt = fst_view.get(token);
+      if (!opt.has_value()) return {};
+      return top_content_entry(*opt, k, threshold);
+    }
+
+    [[nodiscard]] std::vector<ScoredBook> top_title_entry(size_t entry, size_t k, size_t threshold = 0) const
+    {
+      return top(entry, k, threshold, impact == ImpactOrder::Title, [](auto&& r) { return r.title_freq; });
+    }
+
+    [[nodiscard]] std::vector<ScoredBook> top_content_entry(size_t entry, size_t k, size_t threshold = 0) const
+    {
+      return top(entry, k, threshold, impact == ImpactOrder::Content, [](auto&& r) { return r.content_freq; });
+    }
+
+    // Used when the entry has already been located by the global dictionary.
+    [[nodiscard]] std::vector<std::string> search_title_entry(size_t entry) const
+    {
+      return search_entry(entry, [](auto&& r) { return r.title_freq; });
+    }
+
+    [[nodiscard]] std::vector<std::string> search_content_entry(size_t entry) const
+    {
+      return search_entry(entry, [](auto&& r) { return r.content_freq; });
+    }
+
+    // The books whose tokens contain `pattern`, each listed once.
+    [[nodiscard]] std::vector<std::string> search_title_substring(const std::string& pattern) const
+    {
+      return search_substring(pattern, [](auto&& r) { return r.title_freq; });
+    }
+
+    [[nodiscard]] std::vector<std::string> search_content_substring(const std::string& pattern) const
+    {
+      return search_substring(pattern, [](auto&& r) { return r.content_freq; });
+    }
+
+    // The entries of the tokens containing `pattern`, in increasing order.
+    // Candidates come from intersecting the lists of the pattern's trigrams,
+    // and are checked against the token the FST maps back from the entry.
+    // Patterns shorter than a trigram fall back to walking the FST.
+    [[nodiscard]] std::vector<uint32_t> substring_entries(const std::string& pattern) const
+    {
+      std::vector<uint32_t> ret;
+      if (pattern.size() < details::gram_size)
+      {
+        fst_view.for_each([&ret, &pattern](const std::string& token, uint32_t entry)
+        {
+          if (token.find(pattern) != std::string::npos)
+            ret.emplace_back(entry);
+        });
+        std::ranges::sort(ret);
+        return ret;
+      }
+
+      std::vector<uint32_t> keys;
+      for (size_t i = 0; i + details::gram_size <= pattern.size(); ++i)
+        keys.emplace_back(details::trigram(pattern.data() + i));
+      std::ranges::sort(keys);
+      auto [first_dup, last_dup] = std::ranges::unique(keys);
+      keys.erase(first_dup, last_dup);
+
+      std::vector<std::span<const uint32_t> > lists;
+      for (auto&& key : keys)
+      {
+        auto list = gram_entries(key);
+        if (list.empty())
+          return {};
+        lists.emplace_back(list);
+      }
+      std::ranges::sort(lists, {}, [](auto&& r) { return r.size(); });
+
+      ret.assign(lists[0].begin(), lists[0].end());
+      for (size_t i = 1; i < lists.size() && !ret.empty(); ++i)
+      {
+        // The candidates are usually far fewer than the list, so each one
+        // is searched for rather than merging the two.
+        auto first = lists[i].begin();
+        std::erase_if(ret, [&first, &lists, i](uint32_t entry)
+        {
+          first = std::lower_bound(first, lists[i].end(), entry);
+          return first == lists[i].end() || *first != entry;
+        });
+      }
+
+      if (pattern.size() > details::gram_size)
+      {
+        std::erase_if(ret, [this, &pattern](uint32_t entry)
+        {
+          auto token = fst_view.get_word(entry);
+          return !token.has_value() || token->find(pattern) == std::string::npos;
+        });
+      }
+      return ret;
+    }
+
+    [[nodiscard]] std::string book_path(size_t idx) const
+    {
+      std::vector<size_t> paths;
+      auto pcurr = paths_view.paths + paths_view.jump_table[idx] / sizeof(uint32_t);
+      size_t plen = 0;
+      if (idx != paths_view.jump_table_size - 1)
+        plen = paths_view.paths + paths_view.jump_table[idx + 1] / sizeof(uint32_t) - pcurr;
+      else
+        plen = paths_view.paths + paths_view.size / sizeof(uint32_t) - pcurr;
+      for (size_t i = 0; i < plen; ++i)
+        paths.emplace_back(*(pcurr + i));
+
+      std::string path;
+
+      for(auto&& name_idx : paths)
+      {
+        auto ncurr = names_view.names + names_view.jump_table[name_idx];
+        for(;*ncurr != '\0'; ++ncurr)
+          path += *ncurr;
+        path += "/";
+      }
+      path.pop_back();
+      return path;
+    }
+
+    [[nodiscard]] const BookMeta& book_meta(size_t idx) const
+    {
+      return meta_view[idx];
+    }
+
+    // The tokens of every book, recovered from the postings so that a book
+    // can be moved into another segment without reading it again.
+    [[nodiscard]] std::vector<std::vector<TokenFreq> > book_tokens() const
+    {
+      std::vector<std::vector<TokenFreq> > ret;
+      ret.resize(books());
+      fst_view.for_each([this, &ret](const std::string& token, uint32_t entry_idx)
+      {
+        for (auto&& entry : postings(entry_idx))
+          ret[entry.idx].emplace_back(token, entry.title_freq, entry.content_freq);
+      });
+      return ret;
+    }
+
+    [[nodiscard]] std::span<const BookEntry> postings(size_t entry_idx) const
+    {
+      auto ecurr = entries_view.books + entries_view.jump_table[entry_idx] / sizeof(BookEntry);
+      size_t elen = 0;
+      if (entry_idx != entries_view.jump_table_size - 1)
+        elen = entries_view.books + entries_view.jump_table[entry_idx + 1] / sizeof(BookEntry) - ecurr;
+      else
+        elen = entries_view.books + entries_view.size / sizeof(BookEntry) - ecurr;
+      return {ecurr, elen};
+    }
+
   private:
+    [[nodiscard]] std::span<const uint32_t> gram_entries(uint32_t gram) const
+    {
+      auto grams_end = grams_view.grams + grams_view.jump_table_size;
+      auto it = std::lower_bound(grams_view.grams, grams_end, gram);
+      if (it == grams_end || *it != gram)
+        return {};
+      size_t i = it - grams_view.grams;
+      auto gcurr = grams_view.entries + grams_view.jump_table[i] / sizeof(uint32_t);
+      size_t glen = 0;
+      if (i != grams_view.jump_table_size - 1)
+        glen = grams_view.entries + grams_view.jump_table[i + 1] / sizeof(uint32_t) - gcurr;
+      else
+        glen = grams_view.entries + grams_view.size / sizeof(uint32_t) - gcurr;
+      return {gcurr, glen};
+    }
+
+    [[nodiscard]] BookSet book_set(const std::string& token, bool title) const
+    {
+      if (!may_contain(token))
+        return BookSet{books()};
+      auto opt = fst_view.get(token);
+      if (!opt.has_value())
+        return BookSet{books()};
+
+      auto sets_end = sets_view.entries + sets_view.jump_table_size;
+      if (auto it = std::lower_bound(sets_view.entries, sets_end, *opt); it != sets_end && *it == *opt)
+      {
+        auto curr = sets_view.sets + sets_view.jump_table[it - sets_view.entries];
+        auto title_set = BookSet::deserialize(curr);
+        if (title)
+          return title_set;
+        return BookSet::deserialize(curr);
+      }
+
+      std::vector<size_t> idx;
+      for (auto&& entry : postings(*opt))
+      {
+        if ((title ? entry.title_freq : entry.content_freq) != 0)
+          idx.emplace_back(entry.idx);
+      }
+      if (impact != ImpactOrder::None)
+        std::ranges::sort(idx);
+      return BookSet::from_sorted(idx, books());
+    }
+
+    // With impact ordered postings the frequency never increases along the
+    // list, so every posting bounds all the ones after it and reading stops
+    // as soon as one can't enter the heap.
+    template<typename Proj>
+    [[nodiscard]] std::vector<ScoredBook> top(size_t entry_idx, size_t k, size_t threshold, bool ordered,
+                                              Proj&& proj) const
+    {
+      auto cmp = [](auto&& a, auto&& b) { return a.freq > b.freq; };
+      std::vector<ScoredBook> heap;
+      if (k == 0) return heap;
+      for (auto&& entry : postings(entry_idx))
+      {
+        auto freq = proj(entry);
+        if (freq <= threshold || (heap.size() == k && freq <= heap.front().freq))
+        {
+          if (ordered) break;
+          continue;
+        }
+        heap.emplace_back(freq, entry.idx);
+        std::ranges::push_heap(heap, cmp);
+        if (heap.size() > k)
+        {
+          std::ranges::pop_heap(heap, cmp);
+          heap.pop_back();
+        }
+      }
+      std::ranges::sort_heap(heap, cmp);
+      return heap;
+    }
+
     template<typename Proj>
     [[nodiscard]] std::vector<std::string> search(const std::string& token, Proj&& proj) const
     {
-      std::vector<std::string> ret;
+      if (!may_contain(token))
+        return {};
       if (auto opt = fst_view.get(token); opt.has_value())
-      {
-        std::vector<BookEntry> entries;
+        return search_entry(*opt, std::forward<Proj>(proj));
+      return {};
+    }
 
-        auto ecurr = entries_view.books + entries_view.jump_table[*opt] / sizeof(BookEntry);
-        size_t elen = 0;
-        if (*opt != entries_view.jump_table_size - 1)
-          elen = entries_view.books + entries_view.jump_table[*opt + 1] / sizeof(BookEntry) - ecurr;
-        else
-          elen = entries_view.books + entries_view.size / sizeof(BookEntry) - ecurr;
-        for (size_t i = 0; i < elen; ++i)
-          entries.emplace_back(*(ecurr + i));
-        // We use different chunks to store fst, so the sort is meaningless.
-        // std::ranges::sort(entries, std::greater{}, std::forward<Proj>(proj));
-        for (auto& entry : entries)
+    template<typename Proj>
+    [[nodiscard]] std::vector<std::string> search_substring(const std::string& pattern, Proj&& proj) const
+    {
+      std::vector<size_t> idx;
+      for (auto&& entry_idx : substring_entries(pattern))
+      {
+        for (auto&& entry : postings(entry_idx))
         {
-          // Since we didn't sort, we need to `continue` rather than `break`.
-          if (proj(entry) == 0)
-            continue;
-          std::vector<size_t> paths;
-          auto pcurr = paths_view.paths + paths_view.jump_table[entry.idx] / sizeof(uint32_t);
-          size_t plen = 0;
-          if (entry.idx != paths_view.jump_table_size - 1)
-            plen = paths_view.paths + paths_view.jump_table[entry.idx + 1] / sizeof(uint32_t) - pcurr;
-          else
-            plen = paths_view.paths + paths_view.size / sizeof(uint32_t) - pcurr;
-          for (size_t i = 0; i < plen; ++i)
-            paths.emplace_back(*(pcurr + i));
-
-          std::string path;
-
-          for(auto&& name_idx : paths)
-          {
-            auto ncurr = names_view.names + names_view.jump_table[name_idx];
-            for(;*ncurr != '\0'; ++ncurr)
-              path += *ncurr;
-            path += "/";
-          }
-          path.pop_back();
-          ret.emplace_back(path);
+          if (proj(entry) != 0)
+            idx.emplace_back(entry.idx);
         }
       }
+      std::ranges::sort(idx);
+      auto [first, last] = std::ranges::unique(idx);
+      idx.erase(first, last);
+
+      std::vector<std::string> ret;
+      for (auto&& i : idx)
+        ret.emplace_back(book_path(i));
+      return ret;
+    }
+
+    template<typename Proj>
+    [[nodiscard]] std::vector<std::string> search_entry(size_t entry_idx, Proj&& proj) const
+    {
+      std::vector<std::string> ret;
+      auto entries = postings(entry_idx);
+      // Postings are only sorted within a chunk, and maybe by the other
+      // frequency, so see `top` for ranked results.
+      for (auto& entry : entries)
+      {
+        // Since we didn't sort, we need to `continue` rather than `break`.
+        if (proj(entry) == 0)
+          continue;
+        ret.emplace_back(book_path(entry.idx));
+      }
       return ret;
     }
   };
@@ -151,95 +536,246 @@ namespace txtfst
     std::vector<Entry> entries; // unique to a token
     std::vector<std::vector<uint32_t> > book_paths; // store all the book paths
     std::vector<std::string> names; // store all the names
-
-    [[nodiscard]] std::vector<char> compile() const
+    std::string min_term; // the smallest token, used to skip the segment
+    std::string max_term; // the largest token, used to skip the segment
+    BloomFilter filter; // over all the tokens, used to skip the segment
+    ImpactOrder impact{ImpactOrder::None}; // how the books of each entry are sorted
+    std::map<uint32_t, std::vector<uint32_t> > grams; // the sorted entries of the tokens containing a trigram
+    std::vector<BookMeta> book_meta; // unique to a book
+
+    // Section offsets relative to the end of the header. They are computed
+    // before anything is written, so a segment can be streamed in one pass.
+    struct Layout
     {
-      std::vector<char> ret;
-
-      std::vector<uint64_t> names_table;
-      names_table.resize(names.size());
-      ret.resize(names_table.size() * sizeof(uint64_t));
-      size_t offset = ret.size();
-      for (size_t i = 0; i < names.size(); ++i)
+      std::string header;
+      size_t names_pos{0};
+      size_t paths_pos{0};
+      size_t entries_pos{0};
+      size_t fst_pos{0};
+      size_t sets_pos{0};
+      size_t grams_pos{0};
+      size_t meta_pos{0};
+      size_t body_size{0};
+      std::vector<uint32_t> sets_entries;
+      std::vector<uint64_t> sets_table;
+      std::vector<char> sets;
+
+      [[nodiscard]] size_t size() const
       {
-        names_table[i] = ret.size() - offset;
-        ret.insert(ret.end(), names[i].cbegin(), names[i].cend());
-        ret.insert(ret.end(), '\0');
+        return sizeof(uint64_t) + header.size() + body_size;
       }
-      std::memmove(ret.data(), names_table.data(), names_table.size() * sizeof(uint64_t));
+    };
 
-      size_t paths_table_pos = ret.size();
-      std::vector<uint64_t> paths_table;
-      paths_table.resize(book_paths.size());
-      ret.resize(ret.size() + paths_table.size() * sizeof(uint64_t));
+    [[nodiscard]] Layout layout() const
+    {
+      Layout ret;
 
-      offset = ret.size();
-      size_t path_offset = 0;
-      for (size_t i = 0; i < book_paths.size(); ++i)
-      {
-        paths_table[i] = ret.size() - offset;
-        ret.resize(ret.size() + book_paths[i].size() * sizeof(uint32_t));
-        std::memmove(ret.data() + offset + path_offset, book_paths[i].data(),
-                     sizeof(uint32_t) * book_paths[i].size());
-        path_offset += sizeof(uint32_t) * book_paths[i].size();
-      }
-      std::memmove(ret.data() + paths_table_pos, paths_table.data(), paths_table.size() * sizeof(uint64_t));
-
-      size_t entries_table_pos = ret.size();
-      std::vector<uint64_t> entries_table;
-      entries_table.resize(entries.size());
-      ret.resize(ret.size() + entries_table.size() * sizeof(uint64_t));
-      offset = ret.size();
-      size_t entry_offset = 0;
+      // The filter is placed right after the header so that probing it
+      // doesn't fault in any other page of the segment.
+      size_t pos = filter.words.size() * sizeof(uint64_t);
+
+      ret.names_pos = pos;
+      pos += names.size() * sizeof(uint64_t);
+      for (auto&& name : names)
+        pos += name.size() + 1;
+
+      ret.paths_pos = pos;
+      pos += book_paths.size() * sizeof(uint64_t);
+      for (auto&& path : book_paths)
+        pos += path.size() * sizeof(uint32_t);
+
+      ret.entries_pos = pos;
+      pos += entries.size() * sizeof(uint64_t);
+      for (auto&& entry : entries)
+        pos += entry.books.size() * sizeof(BookEntry);
+
+      ret.fst_pos = pos;
+      pos += fst.compiled_size();
+
+      // The book sets are small next to the rest, so they are encoded here.
       for (size_t i = 0; i < entries.size(); ++i)
       {
-        entries_table[i] = ret.size() - offset;
-        ret.resize(ret.size() + entries[i].books.size() * sizeof(BookEntry));
-        std::memmove(ret.data() + offset + entry_offset, entries[i].books.data(),
-                     entries[i].books.size() * sizeof(BookEntry));
-        entry_offset += entries[i].books.size() * sizeof(BookEntry);
+        if (entries[i].books.size() * details::dense_posting_ratio < book_paths.size())
+          continue;
+        std::vector<size_t> title_books, content_books;
+        for (auto&& book : entries[i].books)
+        {
+          if (book.title_freq != 0) title_books.emplace_back(book.idx);
+          if (book.content_freq != 0) content_books.emplace_back(book.idx);
+        }
+        if (impact != ImpactOrder::None)
+        {
+          std::ranges::sort(title_books);
+          std::ranges::sort(content_books);
+        }
+        ret.sets_entries.emplace_back(i);
+        ret.sets_table.emplace_back(ret.sets.size());
+        BookSet::from_sorted(title_books, book_paths.size()).serialize(ret.sets);
+        BookSet::from_sorted(content_books, book_paths.size()).serialize(ret.sets);
       }
-      std::memmove(ret.data() + entries_table_pos, entries_table.data(), entries_table.size() * sizeof(uint64_t));
+      ret.sets_pos = pos;
+      pos += ret.sets_entries.size() * sizeof(uint32_t) + ret.sets_table.size() * sizeof(uint64_t) + ret.sets.size();
+
+      ret.grams_pos = pos;
+      pos += grams.size() * (sizeof(uint32_t) + sizeof(uint64_t));
+      for (auto&& gram : grams)
+        pos += gram.second.size() * sizeof(uint32_t);
+
+      ret.meta_pos = pos;
+      pos += book_meta.size() * sizeof(BookMeta);
+      ret.body_size = pos;
+
+      ret.header = packme::pack(std::make_tuple(ret.names_pos, names.size(), ret.paths_pos, book_paths.size(),
+                                                ret.entries_pos, entries.size(), ret.fst_pos, fst.states.size(),
+                                                size_t{0}, filter.words.size(), ret.sets_pos,
+                                                ret.sets_table.size(), ret.grams_pos, grams.size(), ret.meta_pos, impact,
+                                                min_term, max_term));
+      return ret;
+    }
 
-      size_t fst_table_pos = ret.size();
-      std::vector<uint64_t> fst_table;
-      fst_table.resize(fst.states.size());
-      ret.resize(ret.size() + fst_table.size() * sizeof(uint64_t));
+    // `make_writer(pos)` returns a writer starting at `pos` bytes into the
+    // segment. Every section is written into its own precomputed range, and
+    // the entries and the FST are further split into `jobs` ranges, so up to
+    // `jobs` threads can serialize the segment at once.
+    template<typename MakeWriter>
+    bool compile(MakeWriter&& make_writer, const Layout& layout, size_t jobs = 1) const
+    {
+      size_t body = sizeof(uint64_t) + layout.header.size();
+      std::vector<std::function<bool()> > tasks;
 
-      offset = ret.size();
-      size_t fst_offset = 0;
-      for (const auto& state : fst.states)
+      tasks.emplace_back([&]
       {
-        size_t expected = sizeof(state.id) + sizeof(state.final) + state.trans.size() * sizeof(State<uint32_t>::Arc);
-        if (ret.size() - offset - fst_offset < expected)
-          ret.resize(ret.size() + expected * 2);
-
-        fst_table[state.id] = fst_offset;
-        std::memmove(ret.data() + offset + fst_offset, &state.id, sizeof(state.id));
-        fst_offset += sizeof(state.id);
-        std::memmove(ret.data() + offset + fst_offset, &state.final, sizeof(state.final));
-        fst_offset += sizeof(state.final);
-        for (auto&& arc : state.trans)
+        auto writer = make_writer(0);
+        uint64_t packed_size = layout.header.size();
+        writer.write(&packed_size, sizeof(uint64_t));
+        writer.write(layout.header.data(), layout.header.size());
+
+        writer.write(filter.words.data(), filter.words.size() * sizeof(uint64_t));
+
+        uint64_t offset = 0;
+        for (auto&& name : names)
         {
-          std::memmove(ret.data() + offset + fst_offset, &arc, sizeof(arc));
-          fst_offset += sizeof(arc);
+          writer.write(&offset, sizeof(uint64_t));
+          offset += name.size() + 1;
         }
-      }
-      std::memmove(ret.data() + fst_table_pos, fst_table.data(), fst_table.size() * sizeof(uint64_t));
+        for (auto&& name : names)
+          writer.write(name.c_str(), name.size() + 1);
 
-      auto packed = packme::pack(std::make_tuple(0, names_table.size(), paths_table_pos, paths_table.size(),
-                                                 entries_table_pos, entries_table.size(), fst_table_pos,
-                                                 fst_table.size()));
-      size_t packed_size = packed.size();
+        offset = 0;
+        for (auto&& path : book_paths)
+        {
+          writer.write(&offset, sizeof(uint64_t));
+          offset += path.size() * sizeof(uint32_t);
+        }
+        for (auto&& path : book_paths)
+          writer.write(path.data(), path.size() * sizeof(uint32_t));
+        return writer.flush();
+      });
 
+      tasks.emplace_back([&]
+      {
+        auto writer = make_writer(body + layout.sets_pos);
+        writer.write(layout.sets_entries.data(), layout.sets_entries.size() * sizeof(uint32_t));
+        writer.write(layout.sets_table.data(), layout.sets_table.size() * sizeof(uint64_t));
+        writer.write(layout.sets.data(), layout.sets.size());
+        return writer.flush();
+      });
+
+      tasks.emplace_back([&]
+      {
+        auto writer = make_writer(body + layout.grams_pos);
+        for (auto&& gram : grams)
+          writer.write(&gram.first, sizeof(uint32_t));
+        uint64_t offset = 0;
+        for (auto&& gram : grams)
+        {
+          writer.write(&offset, sizeof(uint64_t));
+          offset += gram.second.size() * sizeof(uint32_t);
+        }
+        for (auto&& gram : grams)
+          writer.write(gram.second.data(), gram.second.size() * sizeof(uint32_t));
+        writer.write(book_meta.data(), book_meta.size() * sizeof(BookMeta));
+        return writer.flush();
+      });
+
+      std::vector<uint64_t> entry_offsets{0};
+      for (auto&& entry : entries)
+        entry_offsets.emplace_back(entry_offsets.back() + entry.books.size() * sizeof(BookEntry));
+      add_table_tasks(tasks, make_writer, body + layout.entries_pos, entry_offsets, jobs,
+                      [this](auto& writer, size_t i)
+                      {
+                        writer.write(entries[i].books.data(), entries[i].books.size() * sizeof(BookEntry));
+                      });
+
+      std::vector<uint64_t> state_offsets{0};
+      for (auto&& state : fst.states)
+        state_offsets.emplace_back(state_offsets.back() + FST<uint32_t>::state_size(state));
+      add_table_tasks(tasks, make_writer, body + layout.fst_pos, state_offsets, jobs,
+                      [this](auto& writer, size_t i)
+                      {
+                        FST<uint32_t>::write_state(writer, fst.states[i]);
+                      });
+
+      std::atomic<bool> good(true);
+      std::atomic<size_t> next(0);
+      auto run = [&tasks, &good, &next]
+      {
+        for (size_t i = next++; i < tasks.size(); i = next++)
+        {
+          if (!tasks[i]())
+            good = false;
+        }
+      };
+      std::vector<std::thread> workers;
+      for (size_t i = 1; i < (std::min)(jobs, tasks.size()); ++i)
+        workers.emplace_back(run);
+      run();
+      for (auto&& worker : workers)
+        worker.join();
+      return good;
+    }
 
-      std::vector<char> final;
-      final.resize(packed_size + ret.size() + sizeof(uint64_t));
-      std::memmove(final.data(), &packed_size, sizeof(uint64_t));
-      std::memmove(final.data() + sizeof(uint64_t), packed.data(), packed_size);
-      std::memmove(final.data() + sizeof(uint64_t) + packed_size, ret.data(), ret.size());
+    [[nodiscard]] std::vector<char> compile() const
+    {
+      auto l = layout();
+      std::vector<char> ret;
+      ret.resize(l.size());
+      compile([&ret](size_t pos) { return BufferWriter{ret.data() + pos}; }, l);
+      return ret;
+    }
 
-      return final;
+  private:
+    // Splits a section made of a jump table followed by its items into
+    // ranges of roughly equal bytes. `offsets` holds the prefix sums of the
+    // item sizes, with a trailing total.
+    template<typename MakeWriter, typename WriteItem>
+    static void add_table_tasks(std::vector<std::function<bool()> >& tasks, MakeWriter& make_writer, size_t pos,
+                                const std::vector<uint64_t>& offsets, size_t jobs, WriteItem write_item)
+    {
+      size_t items = offsets.size() - 1;
+      size_t data_pos = pos + items * sizeof(uint64_t);
+      size_t parts = (std::max)(size_t{1}, jobs);
+      size_t first = 0;
+      for (size_t part = 1; part <= parts && first < items; ++part)
+      {
+        size_t last = items;
+        if (part != parts)
+        {
+          auto target = offsets.back() / parts * part;
+          last = std::lower_bound(offsets.begin() + first, offsets.end() - 1, target) - offsets.begin();
+          if (last <= first) continue;
+        }
+        tasks.emplace_back([&make_writer, &offsets, pos, data_pos, first, last, write_item]
+        {
+          auto table_writer = make_writer(pos + first * sizeof(uint64_t));
+          table_writer.write(offsets.data() + first, (last - first) * sizeof(uint64_t));
+          auto writer = make_writer(data_pos + offsets[first]);
+          for (size_t i = first; i < last; ++i)
+            write_item(writer, i);
+          return table_writer.flush() && writer.flush();
+        });
+        first = last;
+      }
     }
   };
 
@@ -247,16 +783,175 @@ namespace txtfst
   {
     std::vector<std::string> names;
     std::vector<std::vector<uint32_t> > book_paths;
+    std::vector<BookMeta> book_meta;
     std::vector<Entry> merged_entries;
-    std::map<std::string, std::map<size_t, BookEntry> > unmerged_tokens;
-    FSTBuilder<uint32_t> fst_builder;
+    // Each token of the segment is stored once in `arena`, and its postings
+    // are kept by its id, in the order the books were added.
+    TermArena arena;
+    std::vector<std::vector<BookEntry> > unmerged_postings;
+    ImpactOrder impact;
+    size_t postings{0};
+    size_t path_bytes{0};
 
   public:
+    explicit IndexBuilder(ImpactOrder impact_ = ImpactOrder::None) : impact(impact_)
+    {
+    }
+
     IndexBuilder& add_book(const std::string& path,
                            const std::vector<std::string>& title,
-                           const std::vector<std::string>& content)
+                           const std::vector<std::string>& content,
+                           const BookMeta& meta = {})
+    {
+      add_path(path, meta);
+      add_tokens(title, content);
+      return *this;
+    }
+
+    // Like above, but the tokens are only copied the first time the segment
+    // sees them, e.g. from a reused `BookView`.
+    IndexBuilder& add_book(const std::string& path,
+                           const std::vector<std::string_view>& title,
+                           const std::vector<std::string_view>& content,
+                           const BookMeta& meta = {})
+    {
+      add_path(path, meta);
+      add_tokens(title, content);
+      return *this;
+    }
+
+    // For books streamed a block at a time: `begin_book`, then `add_token`
+    // for each token, then `end_book` once the metadata is known.
+    IndexBuilder& begin_book(const std::string& path)
+    {
+      add_path(path, {});
+      return *this;
+    }
+
+    IndexBuilder& add_token(std::string_view token, bool title)
+    {
+      size_t curr_book = book_paths.size() - 1;
+      auto id = arena.intern(token);
+      auto& list = token_postings(id);
+      if (list.empty() || list.back().idx != curr_book)
+        add_posting(id, {curr_book, 0, 0});
+      if (title)
+        ++list.back().title_freq;
+      else
+        ++list.back().content_freq;
+      return *this;
+    }
+
+    IndexBuilder& end_book(const BookMeta& meta)
+    {
+      book_meta.back() = meta;
+      return *this;
+    }
+
+    // Adds a book whose tokens have already been counted by their ids in
+    // `terms`, e.g. the arena a tokenizer thread counted the book with,
+    // touching each distinct token once.
+    IndexBuilder& add_book(const std::string& path, const TermArena& terms, const TermCounts& counts,
+                           const BookMeta& meta = {})
+    {
+      auto curr_book = add_path(path, meta);
+      counts.for_each([this, &terms, curr_book](uint32_t id, size_t title_freq, size_t content_freq)
+      {
+        add_posting(arena.intern(terms.term(id)), {curr_book, title_freq, content_freq});
+      });
+      return *this;
+    }
+
+    // Adds a book whose tokens have already been counted, e.g. by
+    // `IndexView::book_tokens`.
+    IndexBuilder& add_book(const std::string& path, const std::vector<TokenFreq>& tokens, const BookMeta& meta)
+    {
+      auto curr_book = add_path(path, meta);
+      for (auto&& t : tokens)
+        add_posting(arena.intern(t.token), {curr_book, t.title_freq, t.content_freq});
+      return *this;
+    }
+
+    // An estimate of the bytes the segment holds, plus what build() adds for
+    // its FST, filter and trigram lists, which grows with the number of
+    // terms. Cheap enough to check after every book.
+    [[nodiscard]] size_t memory() const
+    {
+      constexpr size_t build_bytes_per_term = 128;
+      return arena.memory() + arena.size() * build_bytes_per_term
+             + unmerged_postings.capacity() * sizeof(std::vector<BookEntry>)
+             + postings * sizeof(BookEntry) + path_bytes;
+    }
+
+    // The FST is built on up to `jobs` threads once the rest is done.
+    Index build(size_t jobs = 1)
+    {
+      // The tokens are only sorted here, once, and everything before works
+      // on their ids.
+      auto ids = arena.sorted();
+      BloomFilter filter(ids.size());
+      std::string min_term, max_term;
+      if (!ids.empty())
+      {
+        min_term = arena.term(ids.front());
+        max_term = arena.term(ids.back());
+      }
+      std::map<uint32_t, std::vector<uint32_t> > grams;
+      for (auto id : ids)
+      {
+        auto token = arena.term(id);
+        auto entry_idx = static_cast<uint32_t>(merged_entries.size());
+        for (size_t i = 0; i + details::gram_size <= token.size(); ++i)
+        {
+          // Entries are added in increasing order, so each list stays sorted.
+          auto& list = grams[details::trigram(token.data() + i)];
+          if (list.empty() || list.back() != entry_idx)
+            list.emplace_back(entry_idx);
+        }
+        filter.add(token);
+        auto book_entries = std::move(unmerged_postings[id]);
+        if (impact == ImpactOrder::Title)
+          std::ranges::stable_sort(book_entries, std::greater{}, [](auto&& e) { return e.title_freq; });
+        else if (impact == ImpactOrder::Content)
+          std::ranges::stable_sort(book_entries, std::greater{}, [](auto&& e) { return e.content_freq; });
+        merged_entries.emplace_back(std::move(book_entries));
+      }
+      auto fst = build_fst<uint32_t>(ids.size(), [this, &ids](size_t i) { return arena.term(ids[i]); }, jobs);
+      return Index{
+        std::move(fst), std::move(merged_entries), std::move(book_paths), std::move(names),
+        std::move(min_term), std::move(max_term), std::move(filter), impact, std::move(grams),
+        std::move(book_meta)
+      };
+    }
+
+  private:
+    template<typename Tokens>
+    void add_tokens(const Tokens& title, const Tokens& content)
+    {
+      for (auto&& token : title)
+        add_token(token, true);
+      for (auto&& token : content)
+        add_token(token, false);
+    }
+
+    std::vector<BookEntry>& token_postings(uint32_t id)
+    {
+      if (id >= unmerged_postings.size())
+        unmerged_postings.resize(arena.size());
+      return unmerged_postings[id];
+    }
+
+    BookEntry& add_posting(uint32_t id, const BookEntry& entry)
+    {
+      ++postings;
+      return token_postings(id).emplace_back(entry);
+    }
+
+    size_t add_path(const std::string& path, const BookMeta& meta)
     {
       book_paths.emplace_back();
+      book_meta.emplace_back(meta);
+      path_bytes += path.size() + sizeof(BookMeta) + sizeof(std::vector<uint32_t>);
       for (auto&& name : path | std::views::split('/'))
       {
         auto sv = std::string_view{name};
@@ -269,39 +964,7 @@ namespace txtfst
         else
           book_paths.back().emplace_back(it - names.cbegin());
       }
-
-      auto curr_book = book_paths.size() - 1;
-      for (auto&& token : title)
-      {
-        auto& curr_entry = unmerged_tokens[token];
-        if (auto it = curr_entry.find(curr_book); it == curr_entry.end())
-          curr_entry[curr_book] = BookEntry{curr_book, 1, 0};
-        else
-          ++it->second.title_freq;
-      }
-
-      for (auto&& token : content)
-      {
-        auto& curr_entry = unmerged_tokens[token];
-        if (auto it = curr_entry.find(curr_book); it == curr_entry.end())
-          curr_entry[curr_book] = BookEntry{curr_book, 0, 1};
-        else
-          ++it->second.content_freq;
-      }
-      return *this;
-    }
-
-    Index build()
-    {
-      for (auto&& r : unmerged_tokens)
-      {
-        fst_builder.add(r.first, merged_entries.size());
-        std::vector<BookEntry> book_entries;
-        for (auto&& t : r.second)
-          book_entries.emplace_back(t.second);
-        merged_entries.emplace_back(std::move(book_entries));
-      }
-      return Index{fst_builder.build(), std::move(merged_entries), std::move(book_paths), std::move(names)};
+      return book_paths.size() - 1;
     }
   };
 }
@@ -0,0 +1,137 @@
+#ifndef TXTFST_INTERN_H
+#define TXTFST_INTERN_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <cstdint>
+
+#include "hash.h"
+
+namespace txtfst
+{
+  // Gives each distinct term a dense 32-bit id, in the order the terms are
+  // first seen, and stores its bytes once. The table is open-addressed with
+  // linear probing; each slot holds part of the term's hash next to its id,
+  // so a probe rarely has to look at the bytes of a term that doesn't match.
+  class TermArena
+  {
+    struct Term
+    {
+      uint64_t offset{0}; // in `bytes`
+      uint32_t size{0};
+      uint32_t hash{0};
+    };
+
+    std::string bytes;
+    std::vector<Term> terms;
+    std::vector<uint64_t> table; // hash << 32 | (id + 1), 0 for an empty slot
+
+  public:
+    explicit TermArena(size_t capacity = 1024)
+    {
+      size_t n = 16;
+      while (n * 3 < capacity * 4)
+        n <<= 1;
+      table.resize(n);
+    }
+
+    uint32_t intern(std::string_view term)
+    {
+      auto hash = static_cast<uint32_t>(xxh64(term));
+      size_t mask = table.size() - 1;
+      size_t i = hash & mask;
+      for (; table[i] != 0; i = (i + 1) & mask)
+      {
+        if (static_cast<uint32_t>(table[i] >> 32) != hash)
+          continue;
+        auto id = static_cast<uint32_t>(table[i]) - 1;
+        if (this->term(id) == term)
+          return id;
+      }
+
+      auto id = static_cast<uint32_t>(terms.size());
+      terms.emplace_back(Term{bytes.size(), static_cast<uint32_t>(term.size()), hash});
+      bytes.append(term);
+      table[i] = static_cast<uint64_t>(hash) << 32 | (id + 1);
+      if (terms.size() * 4 > table.size() * 3)
+        grow();
+      return id;
+    }
+
+    // Stays valid until the arena is cleared or more terms are added.
+    [[nodiscard]] std::string_view term(uint32_t id) const
+    {
+      auto& t = terms[id];
+      return {bytes.data() + t.offset, t.size};
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+      return terms.size();
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+      return terms.empty();
+    }
+
+    // The bytes held by the arena, including its spare capacity.
+    [[nodiscard]] size_t memory() const
+    {
+      return bytes.capacity() + terms.capacity() * sizeof(Term) + table.size() * sizeof(uint64_t);
+    }
+
+    // The ids in the lexicographic order of their terms.
+    [[nodiscard]] std::vector<uint32_t> sorted() const
+    {
+      std::vector<uint32_t> ids(terms.size());
+      std::iota(ids.begin(), ids.end(), 0);
+      std::ranges::sort(ids, std::less{}, [this](uint32_t id) { return term(id); });
+      return ids;
+    }
+
+    // Only resets the slots that were used when the table is mostly empty,
+    // so an arena that once held a large book stays cheap to clear. They are
+    // reset newest first, so the probe for each still finds it.
+    void clear()
+    {
+      if (terms.size() * 8 < table.size())
+      {
+        size_t mask = table.size() - 1;
+        for (auto id = static_cast<uint32_t>(terms.size()); id-- > 0;)
+        {
+          auto hash = terms[id].hash;
+          auto entry = static_cast<uint64_t>(hash) << 32 | (id + 1);
+          size_t i = hash & mask;
+          while (table[i] != entry)
+            i = (i + 1) & mask;
+          table[i] = 0;
+        }
+      }
+      else
+        std::ranges::fill(table, 0);
+      bytes.clear();
+      terms.clear();
+    }
+
+  private:
+    void grow()
+    {
+      table.assign(table.size() * 2, 0);
+      size_t mask = table.size() - 1;
+      for (uint32_t id = 0; id < terms.size(); ++id)
+      {
+        auto hash = terms[id].hash;
+        size_t i = hash & mask;
+        while (table[i] != 0)
+          i = (i + 1) & mask;
+        table[i] = static_cast<uint64_t>(hash) << 32 | (id + 1);
+      }
+    }
+  };
+}
+#endif
@@ -0,0 +1,107 @@
+#ifndef TXTFST_JOURNAL_H
+#define TXTFST_JOURNAL_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "packme/packme.h"
+#include "manifest.h"
+
+namespace txtfst
+{
+  // A segment that has been written in full, and the XXH64 of its bytes.
+  struct JournalEntry
+  {
+    SegmentInfo segment;
+    uint64_t checksum{0};
+  };
+
+  namespace details
+  {
+    inline bool write_record(int fd, std::string_view packed)
+    {
+      uint64_t size = packed.size();
+      std::string record(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
+      record.append(packed);
+      return write(fd, record.data(), record.size()) == static_cast<ssize_t>(record.size());
+    }
+  }
+
+  // Records the segments of an index being built, in the order they are laid
+  // out, so that a build that dies can go on from the last of them. Each
+  // record is its size followed by the packed record; the first one holds
+  // the settings the index is built with, the others a JournalEntry each.
+  class Journal
+  {
+    int fd{-1};
+
+  public:
+    Journal() = default;
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    ~Journal()
+    {
+      if (fd >= 0)
+        close(fd);
+    }
+
+    // Starts the journal over, for a build with `settings`.
+    bool create(const std::string& path, std::string_view settings)
+    {
+      if (fd >= 0)
+        close(fd);
+      fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      return fd >= 0 && details::write_record(fd, packme::pack(std::string(settings))) && fdatasync(fd) == 0;
+    }
+
+    // The segment must already be on disk, so it is never journaled ahead
+    // of its bytes.
+    bool append(const JournalEntry& entry)
+    {
+      return details::write_record(fd, packme::pack(entry)) && fdatasync(fd) == 0;
+    }
+  };
+
+  // The segments journaled at `path`, if it is the journal of a build with
+  // `settings`. A record cut short by a crash ends the journal.
+  inline bool read_journal(const std::string& path, std::string_view settings, std::vector<JournalEntry>& entries)
+  {
+    std::ifstream ifs(path, std::ios::binary);
+    if (ifs.fail())
+      return false;
+    std::string data{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+
+    entries.clear();
+    bool header = true;
+    for (size_t i = 0; i + sizeof(uint64_t) <= data.size();)
+    {
+      uint64_t size;
+      std::memcpy(&size, data.data() + i, sizeof(uint64_t));
+      i += sizeof(uint64_t);
+      if (size > data.size() - i)
+        break;
+      std::string_view packed{data.data() + i, size};
+      i += size;
+      if (header)
+      {
+        if (packme::unpack<std::string>(packed) != settings)
+          return false;
+        header = false;
+      }
+      else
+        entries.emplace_back(packme::unpack<JournalEntry>(packed));
+    }
+    return !header;
+  }
+}
+#endif
@@ -0,0 +1,113 @@
+#ifndef TXTFST_MANIFEST_H
+#define TXTFST_MANIFEST_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include "packme/packme.h"
+
+namespace txtfst
+{
+  // Where a segment is in the index file and what it covers. Books are
+  // numbered across the whole index, in the order of the segments.
+  struct SegmentInfo
+  {
+    uint64_t offset{0}; // of the segment itself, after its size
+    uint64_t size{0};
+    uint64_t first_book{0};
+    uint64_t books{0};
+    std::string min_term;
+    std::string max_term;
+  };
+
+  // The segments, and the options that decide what went into them, which
+  // --update has to build with as well.
+  struct Manifest
+  {
+    std::string settings;
+    std::vector<SegmentInfo> segments;
+    std::vector<std::string> stopwords; // sorted, none without -w
+  };
+
+  namespace details
+  {
+    inline constexpr uint64_t manifest_magic = 0x314d545346545854; // "TXTFSTM1"
+    inline constexpr size_t manifest_footer_size = 2 * sizeof(uint64_t);
+
+    // The packed manifest, or an empty view if there is none.
+    inline std::string_view find_manifest(std::string_view index)
+    {
+      if (index.size() < manifest_footer_size)
+        return {};
+      uint64_t size, magic;
+      auto footer = index.data() + index.size() - manifest_footer_size;
+      std::memcpy(&size, footer, sizeof(uint64_t));
+      std::memcpy(&magic, footer + sizeof(uint64_t), sizeof(uint64_t));
+      if (magic != manifest_magic || size > index.size() - manifest_footer_size)
+        return {};
+      return {footer - size, size};
+    }
+  }
+
+  // The manifest goes after the last segment, followed by its size and a
+  // magic number, so a reader finds it from the end of the file.
+  inline std::string pack_manifest(const Manifest& manifest)
+  {
+    auto packed = packme::pack(manifest);
+    uint64_t size = packed.size();
+    packed.append(reinterpret_cast<const char*>(&size), sizeof(uint64_t));
+    packed.append(reinterpret_cast<const char*>(&details::manifest_magic), sizeof(uint64_t));
+    return packed;
+  }
+
+  // The settings an index was built with, empty if it doesn't say.
+  inline std::string read_settings(std::string_view index)
+  {
+    auto packed = details::find_manifest(index);
+    if (packed.empty())
+      return {};
+    return packme::unpack<Manifest>(packed).settings;
+  }
+
+  // The words the index was built without, sorted.
+  inline std::vector<std::string> read_stopwords(std::string_view index)
+  {
+    auto packed = details::find_manifest(index);
+    if (packed.empty())
+      return {};
+    return packme::unpack<Manifest>(packed).stopwords;
+  }
+
+  // The segments of an index, from its manifest. An index written before
+  // manifests existed is walked by the size in front of each segment
+  // instead, and only gets their offsets and sizes.
+  inline std::vector<SegmentInfo> read_manifest(std::string_view index)
+  {
+    if (auto packed = details::find_manifest(index); !packed.empty())
+      return packme::unpack<Manifest>(packed).segments;
+
+    std::vector<SegmentInfo> segments;
+    for (size_t i = 0; i + sizeof(uint64_t) <= index.size();)
+    {
+      uint64_t size;
+      std::memcpy(&size, index.data() + i, sizeof(uint64_t));
+      segments.emplace_back(SegmentInfo{.offset = i + sizeof(uint64_t), .size = size});
+      i += size + sizeof(uint64_t);
+    }
+    return segments;
+  }
+
+  // The bytes of each segment, in the order of the file.
+  inline std::vector<std::string_view> segment_data(std::string_view index, const std::vector<SegmentInfo>& segments)
+  {
+    std::vector<std::string_view> ret;
+    for (auto&& segment : segments)
+      ret.emplace_back(index.substr(segment.offset, segment.size));
+    return ret;
+  }
+}
+#endif
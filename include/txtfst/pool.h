@@ -0,0 +1,156 @@
+#ifndef TXTFST_POOL_H
+#define TXTFST_POOL_H
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace txtfst
+{
+  // A fixed set of threads, each with its own queue of tasks. A worker takes
+  // the newest task of its own queue first, and when that is empty steals the
+  // oldest task of another, so tasks of very different lengths still keep
+  // every thread busy until the end. Tasks are given the id of the worker
+  // running them, for indexing per-worker state.
+  class ThreadPool
+  {
+  public:
+    using Task = std::move_only_function<void(size_t)>;
+
+  private:
+    struct Queue
+    {
+      std::mutex mtx;
+      std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> threads;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::atomic<size_t> queued{0}; // tasks in the queues
+    std::atomic<size_t> pending{0}; // tasks not yet finished
+    std::atomic<size_t> next_queue{0};
+    bool stopping{false}; // guarded by mtx
+
+    static inline thread_local ThreadPool* current_pool = nullptr;
+    static inline thread_local size_t current_worker = 0;
+
+  public:
+    explicit ThreadPool(size_t workers)
+    {
+      if (workers == 0)
+        workers = 1;
+      for (size_t i = 0; i < workers; ++i)
+        queues.emplace_back(std::make_unique<Queue>());
+      for (size_t i = 0; i < workers; ++i)
+        threads.emplace_back([this, i] { run(i); });
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard l(mtx);
+        stopping = true;
+      }
+      wake.notify_all();
+      for (auto&& t : threads)
+        t.join();
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+      return threads.size();
+    }
+
+    // From a worker, the task goes to its own queue, so it runs next there
+    // unless it is stolen first.
+    void submit(Task task)
+    {
+      auto id = current_pool == this ? current_worker : next_queue++ % queues.size();
+      ++pending;
+      {
+        std::lock_guard l(mtx);
+        ++queued;
+      }
+      {
+        auto& q = *queues[id];
+        std::lock_guard l(q.mtx);
+        q.tasks.emplace_back(std::move(task));
+      }
+      wake.notify_one();
+    }
+
+    // Blocks until every task, including those submitted by tasks, is done.
+    void wait()
+    {
+      std::unique_lock l(mtx);
+      idle.wait(l, [this] { return pending == 0; });
+    }
+
+  private:
+    bool take(size_t id, Task& task)
+    {
+      {
+        auto& own = *queues[id];
+        std::lock_guard l(own.mtx);
+        if (!own.tasks.empty())
+        {
+          task = std::move(own.tasks.back());
+          own.tasks.pop_back();
+          return true;
+        }
+      }
+      for (size_t i = 1; i < queues.size(); ++i)
+      {
+        auto& victim = *queues[(id + i) % queues.size()];
+        std::lock_guard l(victim.mtx);
+        if (!victim.tasks.empty())
+        {
+          task = std::move(victim.tasks.front());
+          victim.tasks.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void run(size_t id)
+    {
+      current_pool = this;
+      current_worker = id;
+      while (true)
+      {
+        Task task;
+        if (take(id, task))
+        {
+          --queued;
+          task(id);
+          if (--pending == 0)
+          {
+            std::lock_guard l(mtx);
+            idle.notify_all();
+          }
+          continue;
+        }
+        // A task counted in `queued` may not be in its queue yet, in which
+        // case this only waits until it is.
+        std::unique_lock l(mtx);
+        wake.wait(l, [this] { return queued != 0 || stopping; });
+        if (stopping && queued == 0)
+          return;
+      }
+    }
+  };
+}
+#endif
@@ -0,0 +1,134 @@
+#ifndef TXTFST_QUEUE_H
+#define TXTFST_QUEUE_H
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <bit>
+#include <algorithm>
+#include <cstddef>
+
+namespace txtfst
+{
+  // A bounded multi-producer multi-consumer queue, after Dmitry Vyukov's.
+  // Each cell carries a sequence number that tells producers and consumers
+  // whose turn it is, so a push or a pop is one CAS on its own end of the
+  // queue and never takes a lock. The blocking push() and pop() back off
+  // to sleeping, since the stages they connect wait on I/O for much longer
+  // than it takes to spin.
+  template<typename T>
+  class BoundedQueue
+  {
+    struct Cell
+    {
+      std::atomic<size_t> sequence;
+      T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+    alignas(64) std::atomic<bool> closed{false};
+
+  public:
+    explicit BoundedQueue(size_t capacity)
+    {
+      capacity = std::bit_ceil((std::max)(capacity, size_t{2}));
+      cells = std::make_unique<Cell[]>(capacity);
+      mask = capacity - 1;
+      for (size_t i = 0; i < capacity; ++i)
+        cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    bool try_push(T& value)
+    {
+      auto pos = enqueue_pos.load(std::memory_order_relaxed);
+      while (true)
+      {
+        auto& cell = cells[pos & mask];
+        auto seq = cell.sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+        if (diff == 0)
+        {
+          if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            cell.data = std::move(value);
+            cell.sequence.store(pos + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (diff < 0)
+          return false; // full
+        else
+          pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    bool try_pop(T& value)
+    {
+      auto pos = dequeue_pos.load(std::memory_order_relaxed);
+      while (true)
+      {
+        auto& cell = cells[pos & mask];
+        auto seq = cell.sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos + 1);
+        if (diff == 0)
+        {
+          if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          {
+            value = std::move(cell.data);
+            cell.sequence.store(pos + mask + 1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (diff < 0)
+          return false; // empty
+        else
+          pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+
+    // Blocks while the queue is full.
+    void push(T value)
+    {
+      for (size_t attempt = 0; !try_push(value); ++attempt)
+        backoff(attempt);
+    }
+
+    // Blocks while the queue is empty. Returns false once it is empty and
+    // closed.
+    bool pop(T& value)
+    {
+      for (size_t attempt = 0;; ++attempt)
+      {
+        if (try_pop(value))
+          return true;
+        if (closed.load(std::memory_order_acquire))
+          return try_pop(value);
+        backoff(attempt);
+      }
+    }
+
+    // Called once every producer is done.
+    void close()
+    {
+      closed.store(true, std::memory_order_release);
+    }
+
+  private:
+    static void backoff(size_t attempt)
+    {
+      if (attempt < 64)
+        std::this_thread::yield();
+      else
+        std::this_thread::sleep_for(std::chrono::microseconds(attempt < 256 ? 10 : 200));
+    }
+  };
+}
+#endif
@@ -0,0 +1,124 @@
+#ifndef TXTFST_SOURCE_H
+#define TXTFST_SOURCE_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace txtfst
+{
+  // Read-only access to the bytes of one file at a time. Files of at least
+  // `mmap_threshold` bytes are mapped; smaller ones are read with pread()
+  // into a buffer kept from one file to the next, since setting up and
+  // tearing down a mapping costs more than copying a few pages.
+  class DocumentSource
+  {
+    std::string buffer;
+    void* mapped{nullptr};
+    size_t mapped_size{0};
+    size_t mmap_threshold;
+
+  public:
+    explicit DocumentSource(size_t mmap_threshold_ = size_t{1} << 20) : mmap_threshold(mmap_threshold_)
+    {
+    }
+
+    DocumentSource(const DocumentSource&) = delete;
+    DocumentSource& operator=(const DocumentSource&) = delete;
+
+    DocumentSource(DocumentSource&& other) noexcept
+      : buffer(std::move(other.buffer)), mapped(std::exchange(other.mapped, nullptr)),
+        mapped_size(std::exchange(other.mapped_size, 0)), mmap_threshold(other.mmap_threshold)
+    {
+    }
+
+    ~DocumentSource()
+    {
+      release();
+    }
+
+    // `data` stays valid until the next call to open() or release().
+    bool open(const std::string& path, std::string_view& data)
+    {
+      release();
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        return false;
+      struct stat statbuf{};
+      if (fstat(fd, &statbuf) != 0)
+      {
+        close(fd);
+        return false;
+      }
+      auto size = static_cast<size_t>(statbuf.st_size);
+
+      if (maps(size))
+      {
+        auto ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+          return false;
+        madvise(ptr, size, MADV_SEQUENTIAL);
+        // Starts reading ahead now, so a caller that opens a file before it
+        // needs it gets it from memory.
+        madvise(ptr, size, MADV_WILLNEED);
+        mapped = ptr;
+        mapped_size = size;
+        data = {static_cast<const char*>(ptr), size};
+        return true;
+      }
+
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      buffer.resize(size);
+      size_t done = 0;
+      while (done < size)
+      {
+        auto got = pread(fd, buffer.data() + done, size - done, static_cast<off_t>(done));
+        if (got <= 0)
+          break;
+        done += got;
+      }
+      close(fd);
+      buffer.resize(done);
+      data = buffer;
+      return true;
+    }
+
+    // Whether open() would map a file of `size` bytes.
+    [[nodiscard]] bool maps(size_t size) const
+    {
+      return size >= mmap_threshold;
+    }
+
+    // For callers that read a file into the pooled buffer themselves, e.g.
+    // through io_uring; view() then hands out what they read.
+    char* buffer_for(size_t size)
+    {
+      release();
+      buffer.resize(size);
+      return buffer.data();
+    }
+
+    [[nodiscard]] std::string_view view(size_t size) const
+    {
+      return {buffer.data(), size};
+    }
+
+    void release()
+    {
+      if (mapped != nullptr)
+      {
+        munmap(mapped, mapped_size);
+        mapped = nullptr;
+        mapped_size = 0;
+      }
+    }
+  };
+}
+#endif
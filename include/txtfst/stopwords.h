@@ -0,0 +1,212 @@
+#ifndef TXTFST_STOPWORDS_H
+#define TXTFST_STOPWORDS_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <span>
+#include <numeric>
+#include <algorithm>
+#include <fstream>
+#include <bit>
+#include <cctype>
+#include <cstdint>
+
+namespace txtfst
+{
+  namespace details
+  {
+    constexpr uint64_t perfect_hash(std::string_view word, uint64_t seed)
+    {
+      uint64_t h = 14695981039346656037ull ^ (seed * 0x9E3779B97F4A7C15ull);
+      for (char c : word)
+      {
+        h ^= static_cast<unsigned char>(c);
+        h *= 1099511628211ull;
+      }
+      h ^= h >> 31;
+      h *= 0xBF58476D1CE4E5B9ull;
+      h ^= h >> 29;
+      return h;
+    }
+
+    // Hash and displace: the words are split into buckets by one hash, then
+    // for each bucket, largest first, a seed is searched for that sends all
+    // of its words to free slots. A lookup is two hashes and one compare.
+    // `words` must be distinct; `slots` is a power of two larger than it and
+    // gets the index + 1 of the word in each slot, 0 for none. `order` is
+    // scratch space of one entry per word.
+    constexpr void build_perfect_hash(std::span<const std::string_view> words, std::span<uint32_t> seeds,
+                                      std::span<uint32_t> slots, std::span<uint32_t> order)
+    {
+      auto bucket = [&](uint32_t i) { return perfect_hash(words[i], 0) % seeds.size(); };
+      std::ranges::fill(seeds, 0);
+      std::ranges::fill(slots, 0);
+      for (uint32_t i = 0; i < words.size(); ++i)
+        ++seeds[bucket(i)];
+      std::iota(order.begin(), order.end(), 0);
+      // `seeds` holds the size of each bucket until its seed is found.
+      std::ranges::sort(order, [&](uint32_t a, uint32_t b)
+      {
+        auto ba = bucket(a), bb = bucket(b);
+        return seeds[ba] != seeds[bb] ? seeds[ba] > seeds[bb] : ba < bb;
+      });
+
+      size_t mask = slots.size() - 1;
+      for (size_t first = 0; first < order.size();)
+      {
+        auto b = bucket(order[first]);
+        size_t last = first + seeds[b];
+        for (uint32_t seed = 1;; ++seed)
+        {
+          size_t placed = first;
+          for (; placed < last; ++placed)
+          {
+            auto& slot = slots[perfect_hash(words[order[placed]], seed) & mask];
+            if (slot != 0)
+              break;
+            slot = order[placed] + 1;
+          }
+          if (placed == last)
+          {
+            seeds[b] = seed;
+            break;
+          }
+          for (size_t i = first; i < placed; ++i)
+            slots[perfect_hash(words[order[i]], seed) & mask] = 0;
+        }
+        first = last;
+      }
+    }
+
+    constexpr bool perfect_hash_contains(std::string_view word, std::span<const std::string_view> words,
+                                         std::span<const uint32_t> seeds, std::span<const uint32_t> slots)
+    {
+      if (words.empty())
+        return false;
+      auto seed = seeds[perfect_hash(word, 0) % seeds.size()];
+      auto slot = slots[perfect_hash(word, seed) & (slots.size() - 1)];
+      return slot != 0 && words[slot - 1] == word;
+    }
+
+    constexpr size_t perfect_hash_buckets(size_t words)
+    {
+      return (std::max)(size_t{1}, (words + 3) / 4);
+    }
+
+    constexpr size_t perfect_hash_slots(size_t words)
+    {
+      return std::bit_ceil(words + words / 4 + 1);
+    }
+
+    // A set of words whose perfect hash is found at compile time.
+    template<size_t N>
+    struct StaticWordSet
+    {
+      std::array<std::string_view, N> words;
+      std::array<uint32_t, perfect_hash_buckets(N)> seeds{};
+      std::array<uint32_t, perfect_hash_slots(N)> slots{};
+
+      consteval explicit StaticWordSet(const std::array<std::string_view, N>& words_) : words(words_)
+      {
+        std::array<uint32_t, N> order{};
+        build_perfect_hash(words, seeds, slots, order);
+      }
+
+      [[nodiscard]] constexpr bool contains(std::string_view word) const
+      {
+        return perfect_hash_contains(word, words, seeds, slots);
+      }
+    };
+
+    // Common English words, as the tokenizer would produce them, so without
+    // the contractions that it splits at the apostrophe.
+    inline constexpr StaticWordSet default_stopwords{
+      std::array<std::string_view, 122>{
+        "a", "about", "above", "after", "again", "against", "all", "am", "an", "and", "any", "are", "as",
+        "at", "be", "because", "been", "before", "being", "below", "between", "both", "but", "by", "can",
+        "could", "did", "do", "does", "doing", "down", "during", "each", "few", "for", "from", "further",
+        "had", "has", "have", "having", "he", "her", "here", "hers", "herself", "him", "himself", "his",
+        "how", "i", "if", "in", "into", "is", "it", "its", "itself", "just", "me", "more", "most", "my",
+        "myself", "no", "nor", "not", "now", "of", "off", "on", "once", "only", "or", "other", "our",
+        "ours", "ourselves", "out", "over", "own", "same", "she", "should", "so", "some", "such", "than",
+        "that", "the", "their", "theirs", "them", "themselves", "then", "there", "these", "they", "this",
+        "those", "through", "to", "too", "under", "until", "up", "very", "was", "we", "were", "what",
+        "when", "where", "which", "while", "who", "whom", "why", "will", "with", "would", "you"
+      }
+    };
+  }
+
+  // Tokens the tokenizer drops before they reach the index, which removes
+  // the longest posting lists. The built-in English list is hashed at compile
+  // time; a custom one is loaded from a file, one word per line, and hashed
+  // the same way at startup.
+  class Stopwords
+  {
+    bool builtin{true};
+    std::vector<std::string> storage;
+    std::vector<std::string_view> words;
+    std::vector<uint32_t> seeds;
+    std::vector<uint32_t> slots;
+
+  public:
+    Stopwords() = default;
+
+    Stopwords(const Stopwords&) = delete;
+    Stopwords& operator=(const Stopwords&) = delete;
+
+    // Words are lowercased, as the tokenizer would see them. Returns false if
+    // the file can't be read.
+    bool load(const std::string& path)
+    {
+      std::ifstream ifs(path);
+      if (ifs.fail())
+        return false;
+      storage.clear();
+      for (std::string line; std::getline(ifs, line);)
+      {
+        std::ranges::transform(line, line.begin(), [](unsigned char c) { return std::tolower(c); });
+        std::erase_if(line, [](unsigned char c) { return std::isspace(c); });
+        if (!line.empty())
+          storage.emplace_back(std::move(line));
+      }
+      std::ranges::sort(storage);
+      storage.erase(std::ranges::unique(storage).begin(), storage.end());
+
+      words.assign(storage.begin(), storage.end());
+      seeds.resize(details::perfect_hash_buckets(words.size()));
+      slots.resize(details::perfect_hash_slots(words.size()));
+      std::vector<uint32_t> order(words.size());
+      details::build_perfect_hash(words, seeds, slots, order);
+      builtin = false;
+      return true;
+    }
+
+    [[nodiscard]] bool contains(std::string_view word) const
+    {
+      if (builtin)
+        return details::default_stopwords.contains(word);
+      return details::perfect_hash_contains(word, words, seeds, slots);
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+      return builtin ? details::default_stopwords.words.size() : words.size();
+    }
+
+    // The words, sorted, for telling one list from another.
+    [[nodiscard]] std::vector<std::string> list() const
+    {
+      std::vector<std::string> ret;
+      if (builtin)
+        ret.assign(details::default_stopwords.words.begin(), details::default_stopwords.words.end());
+      else
+        ret.assign(words.begin(), words.end());
+      std::ranges::sort(ret);
+      return ret;
+    }
+  };
+}
+#endif
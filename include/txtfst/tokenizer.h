@@ -6,68 +6,163 @@
 #include <string>
 #include <vector>
 #include <cassert>
-#include <fstream>
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "hash.h"
+#include "utf8.h"
+#include "source.h"
+#include "counts.h"
+#include "intern.h"
+#include "stopwords.h"
 
 namespace txtfst
 {
   namespace details
   {
-    inline std::tuple<std::vector<std::string>, size_t> tokenize(std::string_view text, int filiter)
+    inline bool is_alnum(char c)
+    {
+      auto u = static_cast<unsigned char>(c);
+      return static_cast<unsigned char>((u | 0x20) - 'a') < 26 || static_cast<unsigned char>(u - '0') < 10;
+    }
+
+    inline char to_lower(char c)
+    {
+      auto u = static_cast<unsigned char>(c);
+      return static_cast<unsigned char>(u - 'A') < 26 ? static_cast<char>(u | 0x20) : c;
+    }
+
+    // Text is classified 64 bytes at a time: the block is lowercased into
+    // `lower` and every alphanumeric byte gets its bit set in the mask.
+    constexpr size_t scan_block = 64;
+
+#if defined(__AVX2__)
+    // x - lo < n, compared unsigned by flipping the sign bits.
+    inline __m256i in_range(__m256i x, char lo, int n)
+    {
+      auto t = _mm256_xor_si256(_mm256_sub_epi8(x, _mm256_set1_epi8(lo)), _mm256_set1_epi8(static_cast<char>(0x80)));
+      return _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(n - 128)), t);
+    }
+
+    inline uint64_t classify(const char* in, char* lower)
+    {
+      auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+      auto upper = in_range(v, 'A', 26);
+      auto l = _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(lower), l);
+      auto alnum = _mm256_or_si256(in_range(l, 'a', 26), in_range(v, '0', 10));
+      return static_cast<uint32_t>(_mm256_movemask_epi8(alnum));
+    }
+
+    constexpr size_t classify_width = 32;
+#elif defined(__SSE2__)
+    inline __m128i in_range(__m128i x, char lo, int n)
+    {
+      auto t = _mm_xor_si128(_mm_sub_epi8(x, _mm_set1_epi8(lo)), _mm_set1_epi8(static_cast<char>(0x80)));
+      return _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(n - 128)), t);
+    }
+
+    inline uint64_t classify(const char* in, char* lower)
+    {
+      auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+      auto upper = in_range(v, 'A', 26);
+      auto l = _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(lower), l);
+      auto alnum = _mm_or_si128(in_range(l, 'a', 26), in_range(v, '0', 10));
+      return static_cast<uint32_t>(_mm_movemask_epi8(alnum));
+    }
+
+    constexpr size_t classify_width = 16;
+#endif
+
+    // `size` must not exceed scan_block. Bits past `size` are zero.
+    inline uint64_t classify_block(const char* in, size_t size, char* lower)
     {
-      size_t error_cnt = 0;
-      auto&& valid_utf8 = text
-                          | std::views::chunk_by([](char, char c) { return (0b11000000 & c) == 0b10000000; })
-                          | std::views::filter([&error_cnt](auto&& codepoint)
-                          {
-                            if ((codepoint.size() == 1 && (codepoint[0] & 0b10000000) != 0)
-                                || (codepoint.size() == 2 && (codepoint[0] & 0b11100000) != 0b11000000)
-                                || (codepoint.size() == 3 && (codepoint[0] & 0b11110000) != 0b11100000)
-                                || (codepoint.size() == 4 && (codepoint[0] & 0b11111000) != 0b11110000)
-                                || codepoint.size() > 4
-                                || codepoint.size() == 0)
-                            {
-                              ++error_cnt;
-                              return false;
-                            }
-                            return true;
-                          });
-
-      std::vector<std::string> ret{""};
-      for (auto&& codepoint : valid_utf8)
+      uint64_t mask = 0;
+      size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+      for (; i + classify_width <= size; i += classify_width)
+        mask |= classify(in + i, lower + i) << i;
+#endif
+      for (; i < size; ++i)
       {
-        if (codepoint.size() == 1 && std::isalnum(codepoint[0]))
-          ret.back() += static_cast<char>(std::tolower(codepoint[0]));
-        else if (!ret.back().empty())
-        {
-          if (filiter != -1 && ret.back().size() < filiter)
-            ret.back().clear();
-          else
-            ret.emplace_back("");
-        }
+        lower[i] = to_lower(in[i]);
+        if (is_alnum(in[i]))
+          mask |= uint64_t{1} << i;
       }
-      ret.pop_back();
-      return {ret, error_cnt};
+      return mask;
     }
 
-    inline std::vector<std::string> unchecked_tokenize(std::string_view text, int filiter)
+    // Lowercases `in` into `out`, which may be the same buffer, and calls
+    // `emit(token)` with a view into `out` of every run of [A-Za-z0-9] that
+    // isn't one of `stopwords`, if given. Runs are found from the masks with
+    // bit scans rather than byte by byte.
+    template<typename Emit>
+    void scan_tokens(const char* in, char* out, size_t size, int filiter, const Stopwords* stopwords, Emit&& emit)
     {
-      std::vector<std::string> ret{""};
-      for (auto&& r : text)
+      auto flush = [out, filiter, stopwords, &emit](size_t first, size_t last)
+      {
+        std::string_view token{out + first, last - first};
+        if ((filiter == -1 || token.size() >= filiter) && (stopwords == nullptr || !stopwords->contains(token)))
+          emit(token);
+      };
+      size_t first = 0;
+      bool in_token = false;
+      for (size_t pos = 0; pos < size; pos += scan_block)
       {
-        if (std::isalnum(r))
-          ret.back() += static_cast<char>(std::tolower(r));
-        else if (!ret.back().empty())
+        size_t n = (std::min)(scan_block, size - pos);
+        auto mask = classify_block(in + pos, n, out + pos);
+        for (size_t i = 0; i < n;)
         {
-          if (filiter != -1 && ret.back().size() < filiter)
-            ret.back().clear();
+          auto rest = mask >> i;
+          if ((rest & 1) != 0)
+          {
+            if (!in_token)
+            {
+              first = pos + i;
+              in_token = true;
+            }
+            i += std::countr_one(rest);
+          }
           else
-            ret.emplace_back("");
+          {
+            if (in_token)
+            {
+              flush(first, pos + i);
+              in_token = false;
+            }
+            i += std::countr_zero(rest);
+          }
         }
       }
-      if (ret.back().empty())
-        ret.pop_back();
+      if (in_token)
+        flush(first, size);
+    }
+
+    inline std::vector<std::string> unchecked_tokenize(std::string_view text, int filiter)
+    {
+      std::string buf{text};
+      std::vector<std::string> ret;
+      scan_tokens(buf.data(), buf.data(), buf.size(), filiter, nullptr,
+                  [&ret](std::string_view token) { ret.emplace_back(token); });
       return ret;
     }
+
+    inline std::tuple<std::vector<std::string>, size_t> tokenize(std::string_view text, int filiter)
+    {
+      std::string buf{text};
+      std::vector<size_t> errors;
+      auto size = drop_invalid_utf8(buf.data(), buf.size(), 0, errors);
+      std::vector<std::string> ret;
+      scan_tokens(buf.data(), buf.data(), size, filiter, nullptr,
+                  [&ret](std::string_view token) { ret.emplace_back(token); });
+      return {ret, errors.size()};
+    }
   }
 
   struct Book
@@ -75,36 +170,243 @@ namespace txtfst
     std::vector<std::string> title;
     std::vector<std::string> content;
     size_t error_cnt{0};
+    uint64_t hash{0}; // of the whole file
+  };
+
+  // The tokens point into `buffer`, which holds the book lowercased. Reusing
+  // one BookView across books keeps the buffers and the token vectors from
+  // being reallocated for every book.
+  struct BookView
+  {
+    DocumentSource source;
+    std::string buffer;
+    std::vector<std::string_view> title;
+    std::vector<std::string_view> content;
+    TermCounts counts; // filled instead of `title` and `content` by count_book()
+    size_t error_cnt{0};
+    std::vector<size_t> error_offsets; // where each invalid sequence started in the file
+    uint64_t hash{0}; // of the whole file
   };
 
-  inline Book tokenize_book(const std::string& path, int filiter, bool check)
+  namespace details
   {
-    std::ifstream ifs(path);
-    assert(!ifs.fail());
-    std::string buf;
-    buf.resize(ifs.seekg(0, std::ios::end).tellg());
-    ifs.seekg(0, std::ios::beg).read(buf.data(), static_cast<std::streamsize>(buf.size()));
-    ifs.close();
-    std::string_view text{buf};
+    // Calls `emit(token, title)` for every token of read-only `data`, which
+    // is only copied if it has invalid UTF-8 to drop.
+    template<typename Emit>
+    void scan_book(std::string_view data, int filiter, const Stopwords* stopwords, bool check, BookView& book,
+                   Emit&& emit)
+    {
+      book.hash = xxh64(data);
+      book.error_cnt = 0;
+      book.error_offsets.clear();
+      book.buffer.resize(data.size());
 
-    Book book;
+      // A book without a newline is all title, as BookStream reads it.
+      auto a = data.find('\n');
+      if (a == std::string_view::npos)
+        a = data.size();
+      size_t title_size = a, content_size = data.size() - a;
+      const char* in = data.data();
+      // Validated before scanning so that the ASCII fast path never has to
+      // look at codepoints.
+      if (check && !(is_valid_utf8(data.substr(0, a)) && is_valid_utf8(data.substr(a))))
+      {
+        std::memcpy(book.buffer.data(), data.data(), data.size());
+        title_size = drop_invalid_utf8(book.buffer.data(), title_size, 0, book.error_offsets);
+        content_size = drop_invalid_utf8(book.buffer.data() + a, content_size, a, book.error_offsets);
+        book.error_cnt = book.error_offsets.size();
+        in = book.buffer.data();
+      }
+      scan_tokens(in, book.buffer.data(), title_size, filiter, stopwords,
+                  [&emit](std::string_view token) { emit(token, true); });
+      scan_tokens(in + a, book.buffer.data() + a, content_size, filiter, stopwords,
+                  [&emit](std::string_view token) { emit(token, false); });
+    }
 
-    auto a = buf.find('\n');
-    assert(a != std::string::npos);
-    size_t content_ecnt = 0;
-    if (check)
+    template<typename Emit>
+    bool scan_book(const std::string& path, int filiter, const Stopwords* stopwords, bool check, BookView& book,
+                   Emit&& emit)
     {
-      std::tie(book.title, book.error_cnt) = details::tokenize(text.substr(0, a), filiter);
-      std::tie(book.content, content_ecnt) = details::tokenize(text.substr(a), filiter);
+      std::string_view data;
+      if (!book.source.open(path, data))
+        return false;
+      scan_book(data, filiter, stopwords, check, book, emit);
+      book.source.release();
+      return true;
     }
-    else
+  }
+
+  inline bool tokenize_book(const std::string& path, int filiter, bool check, BookView& book,
+                            const Stopwords* stopwords = nullptr)
+  {
+    book.title.clear();
+    book.content.clear();
+    return details::scan_book(path, filiter, stopwords, check, book, [&book](std::string_view token, bool title)
+    {
+      (title ? book.title : book.content).emplace_back(token);
+    });
+  }
+
+  // Like tokenize_book(), but only counts each distinct token of the book by
+  // its id in `terms`, which is all an IndexBuilder needs.
+  inline void count_book(std::string_view data, int filiter, bool check, TermArena& terms, BookView& book,
+                         const Stopwords* stopwords = nullptr)
+  {
+    book.counts.clear();
+    details::scan_book(data, filiter, stopwords, check, book, [&book, &terms](std::string_view token, bool title)
+    {
+      book.counts.add(terms.intern(token), title);
+    });
+  }
+
+  inline bool count_book(const std::string& path, int filiter, bool check, TermArena& terms, BookView& book,
+                         const Stopwords* stopwords = nullptr)
+  {
+    book.counts.clear();
+    return details::scan_book(path, filiter, stopwords, check, book, [&book, &terms](std::string_view token, bool title)
+    {
+      book.counts.add(terms.intern(token), title);
+    });
+  }
+
+  // Tokenizes a book a block at a time, so that memory stays within about
+  // `block_size` however large the file is. Only a token or a UTF-8 sequence
+  // cut by the end of a block is carried into the next one; a single token
+  // longer than a block still has to be held whole.
+  class BookStream
+  {
+    std::string buffer;
+    size_t block_size;
+    int fd{-1};
+
+  public:
+    size_t error_cnt{0};
+    std::vector<size_t> error_offsets; // where each invalid sequence started in the file
+    uint64_t hash{0}; // of the whole file
+
+    explicit BookStream(size_t block_size_ = size_t{1} << 26) : block_size(block_size_)
+    {
+    }
+
+    BookStream(const BookStream&) = delete;
+    BookStream& operator=(const BookStream&) = delete;
+
+    BookStream(BookStream&& other) noexcept
+      : buffer(std::move(other.buffer)), block_size(other.block_size), fd(std::exchange(other.fd, -1)),
+        error_cnt(other.error_cnt), error_offsets(std::move(other.error_offsets)), hash(other.hash)
+    {
+    }
+
+    ~BookStream()
     {
-      book.title = details::unchecked_tokenize(text.substr(0, a), filiter);
-      book.content = details::unchecked_tokenize(text.substr(a), filiter);
+      if (fd >= 0)
+        close(fd);
     }
-    book.error_cnt += content_ecnt;
 
-    return book;
+    // Opened apart from tokenize() so that a caller can tell a missing book
+    // from an empty one before acting on its tokens.
+    bool open(const std::string& path)
+    {
+      if (fd >= 0)
+        close(fd);
+      fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0)
+        return false;
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+      return true;
+    }
+
+    // Calls `emit(token, title)` for every token of the opened book, in order.
+    template<typename Emit>
+    void tokenize(int filiter, const Stopwords* stopwords, bool check, Emit&& emit)
+    {
+      assert(fd >= 0);
+      Xxh64 hasher;
+      error_offsets.clear();
+      buffer.clear();
+      bool in_title = true;
+
+      auto scan = [&](size_t first, size_t last)
+      {
+        if (in_title)
+        {
+          auto nl = std::find(buffer.data() + first, buffer.data() + last, '\n') - buffer.data();
+          details::scan_tokens(buffer.data() + first, buffer.data() + first, nl - first, filiter, stopwords,
+                               [&emit](std::string_view token) { emit(token, true); });
+          if (nl == last)
+            return;
+          in_title = false;
+          first = nl;
+        }
+        details::scan_tokens(buffer.data() + first, buffer.data() + first, last - first, filiter, stopwords,
+                             [&emit](std::string_view token) { emit(token, false); });
+      };
+
+      // The buffer holds the validated bytes of a token cut by the last
+      // block, then the bytes of a cut UTF-8 sequence, starting at
+      // `raw_offset` in the file, then the new block.
+      size_t validated = 0;
+      size_t raw_offset = 0;
+      off_t file_offset = 0;
+      for (bool eof = false; !eof;)
+      {
+        size_t old_size = buffer.size();
+        buffer.resize(old_size + block_size);
+        size_t got = 0;
+        while (got < block_size)
+        {
+          auto n = pread(fd, buffer.data() + old_size + got, block_size - got, file_offset + got);
+          if (n <= 0)
+            break;
+          got += n;
+        }
+        buffer.resize(old_size + got);
+        hasher.update({buffer.data() + old_size, got});
+        // Each block is read once, so it needn't stay in the page cache.
+        posix_fadvise(fd, file_offset, got, POSIX_FADV_DONTNEED);
+        file_offset += got;
+        eof = got < block_size;
+
+        size_t raw_end = buffer.size();
+        size_t end = raw_end;
+        if (check)
+        {
+          if (!eof)
+            raw_end -= details::utf8_incomplete_tail(buffer.data() + validated, raw_end - validated);
+          end = validated + drop_invalid_utf8(buffer.data() + validated, raw_end - validated, raw_offset,
+                                              error_offsets);
+        }
+        size_t tail = buffer.size() - raw_end;
+        std::memmove(buffer.data() + end, buffer.data() + raw_end, tail);
+        raw_offset += raw_end - validated;
+
+        size_t stop = end;
+        if (!eof)
+        {
+          while (stop > 0 && details::is_alnum(buffer[stop - 1]))
+            --stop;
+        }
+        scan(0, stop);
+
+        std::memmove(buffer.data(), buffer.data() + stop, end - stop + tail);
+        validated = end - stop;
+        buffer.resize(validated + tail);
+      }
+      close(fd);
+      fd = -1;
+      error_cnt = error_offsets.size();
+      hash = hasher.digest();
+    }
+  };
+
+  inline Book tokenize_book(const std::string& path, int filiter, bool check, const Stopwords* stopwords = nullptr)
+  {
+    BookView view;
+    [[maybe_unused]] bool ok = tokenize_book(path, filiter, check, view, stopwords);
+    assert(ok);
+    return Book{
+      {view.title.begin(), view.title.end()}, {view.content.begin(), view.content.end()}, view.error_cnt, view.hash
+    };
   }
 }
 #endif
@@ -0,0 +1,323 @@
+#ifndef TXTFST_URING_H
+#define TXTFST_URING_H
+#pragma once
+
+#ifdef TXTFST_IO_URING
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "source.h"
+
+namespace txtfst
+{
+  // Just enough of io_uring to submit batches of requests and wait for all
+  // of them, through the raw system calls so that liburing isn't needed.
+  class IoUring
+  {
+    int ring_fd{-1};
+    void* sq_ring{MAP_FAILED};
+    void* cq_ring{MAP_FAILED};
+    size_t sq_ring_size{0};
+    size_t cq_ring_size{0};
+    io_uring_sqe* sqes{static_cast<io_uring_sqe*>(MAP_FAILED)};
+    size_t sqes_size{0};
+
+    unsigned* sq_tail{nullptr};
+    unsigned* sq_array{nullptr};
+    unsigned sq_mask{0};
+    unsigned* cq_head{nullptr};
+    unsigned* cq_tail{nullptr};
+    io_uring_cqe* cqes{nullptr};
+    unsigned cq_mask{0};
+    unsigned pending{0}; // prepared but not yet submitted
+    bool broken{false}; // a submission failed, and what's left in the ring must never go out
+
+  public:
+    explicit IoUring(unsigned entries)
+    {
+      io_uring_params params{};
+      ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      if (ring_fd < 0)
+        return;
+
+      sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+      cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (single_mmap)
+        sq_ring_size = cq_ring_size = (std::max)(sq_ring_size, cq_ring_size);
+      sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                     IORING_OFF_SQ_RING);
+      if (sq_ring == MAP_FAILED)
+        return;
+      if (single_mmap)
+        cq_ring = sq_ring;
+      else
+      {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                       IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+          return;
+      }
+      sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+      if (sqes == MAP_FAILED)
+        return;
+
+      auto sq = static_cast<char*>(sq_ring);
+      sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+      sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+      sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+      auto cq = static_cast<char*>(cq_ring);
+      cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+      cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+      cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+      cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring()
+    {
+      if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+      if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+      if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+      if (ring_fd >= 0)
+        close(ring_fd);
+    }
+
+    // False if the kernel is too old or doesn't allow io_uring here.
+    [[nodiscard]] bool ok() const
+    {
+      return sqes != MAP_FAILED && !broken;
+    }
+
+    [[nodiscard]] unsigned capacity() const
+    {
+      return sq_mask + 1;
+    }
+
+    // Whether the kernel knows all of `opcodes`. A ring can be set up on
+    // kernels that lack some of them, which then complete with -EINVAL.
+    // Kernels too old to be probed are taken to lack them.
+    [[nodiscard]] bool supports(std::span<const uint8_t> opcodes) const
+    {
+      if (!ok())
+        return false;
+      constexpr size_t max_ops = 256;
+      std::vector<char> buffer(sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op));
+      auto probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+      if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, max_ops) < 0)
+        return false;
+      return std::ranges::all_of(opcodes, [probe](uint8_t op)
+      {
+        return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+      });
+    }
+
+    // At most capacity() entries may be prepared between two calls to
+    // submit_and_wait().
+    io_uring_sqe& prepare(uint8_t opcode, int fd, uint64_t user_data)
+    {
+      auto tail = std::atomic_ref(*sq_tail).load(std::memory_order_relaxed) + pending;
+      auto index = tail & sq_mask;
+      auto& sqe = sqes[index];
+      std::memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = opcode;
+      sqe.fd = fd;
+      sqe.user_data = user_data;
+      sq_array[index] = index;
+      ++pending;
+      return sqe;
+    }
+
+    // Submits what was prepared and calls `f(user_data, result)` for each
+    // completion, returning once all of them have completed. If submitting
+    // fails, this still waits for the requests the kernel already took, as
+    // they may write into their buffers until then, and the ring is not
+    // used again. A plain wait only fails on bad arguments, which this
+    // doesn't pass, so it is retried whatever the error.
+    template<typename F>
+    bool submit_and_wait(F&& f)
+    {
+      auto count = pending;
+      std::atomic_ref(*sq_tail).store(*sq_tail + pending, std::memory_order_release);
+      pending = 0;
+      unsigned submitted = 0, completed = 0;
+      while (completed < (broken ? submitted : count))
+      {
+        auto ret = syscall(__NR_io_uring_enter, ring_fd, broken ? 0 : count - submitted, 1,
+                           IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0)
+        {
+          if (!broken && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            broken = true;
+          continue;
+        }
+        if (!broken)
+          submitted += static_cast<unsigned>(ret);
+
+        auto head = std::atomic_ref(*cq_head).load(std::memory_order_relaxed);
+        auto tail = std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+        for (; head != tail; ++head, ++completed)
+        {
+          auto& cqe = cqes[head & cq_mask];
+          f(cqe.user_data, cqe.res);
+        }
+        std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+      }
+      return !broken;
+    }
+  };
+
+  // A book to be read by a BatchReader. One that fails in any way is left
+  // with its `error` for the caller to read again by itself.
+  struct ReadRequest
+  {
+    const std::string* path{nullptr};
+    DocumentSource* source{nullptr};
+    size_t max_size{0}; // larger books are left unread for the caller
+
+    int error{0}; // errno of the first step that failed
+    uint64_t size{0};
+    int64_t mtime{0}; // in nanoseconds
+    bool read{false};
+    std::string_view data; // valid until `source` is used again
+
+    int fd{-1};
+    struct statx stx{};
+  };
+
+  // Reads books a batch at a time: the opens and stats of a batch go to the
+  // kernel in one submission, then the reads, each linked to its close, in
+  // a second. A batch of small books costs two system calls instead of four
+  // per book. Books that DocumentSource would map are left to it.
+  class BatchReader
+  {
+    IoUring ring;
+    bool supported;
+
+  public:
+    explicit BatchReader(unsigned batch_size) : ring(batch_size * 2)
+    {
+      constexpr uint8_t opcodes[]{IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE};
+      supported = ring.supports(opcodes);
+    }
+
+    // False without a ring, on a kernel without the requests it makes, or
+    // once a batch failed to go out.
+    [[nodiscard]] bool ok() const
+    {
+      return supported && ring.ok();
+    }
+
+    // The largest batch that read() accepts.
+    [[nodiscard]] size_t batch_size() const
+    {
+      return ring.capacity() / 2;
+    }
+
+    bool read(std::span<ReadRequest> requests)
+    {
+      if (!ok())
+        return false;
+      for (size_t i = 0; i < requests.size(); ++i)
+      {
+        auto& r = requests[i];
+        r.error = 0;
+        r.read = false;
+        r.fd = -1;
+        auto& open = ring.prepare(IORING_OP_OPENAT, AT_FDCWD, i * 2);
+        open.addr = reinterpret_cast<uint64_t>(r.path->c_str());
+        open.open_flags = O_RDONLY | O_CLOEXEC;
+        auto& stat = ring.prepare(IORING_OP_STATX, AT_FDCWD, i * 2 + 1);
+        stat.addr = reinterpret_cast<uint64_t>(r.path->c_str());
+        stat.len = STATX_SIZE | STATX_MTIME;
+        stat.off = reinterpret_cast<uint64_t>(&r.stx);
+      }
+      bool ok = ring.submit_and_wait([&requests](uint64_t user_data, int res)
+      {
+        auto& r = requests[user_data / 2];
+        if (res < 0)
+          r.error = -res;
+        else if (user_data % 2 == 0)
+          r.fd = res;
+      });
+      if (!ok)
+        return close_all(requests);
+
+      for (size_t i = 0; i < requests.size(); ++i)
+      {
+        auto& r = requests[i];
+        if (r.fd < 0)
+          continue;
+        if (r.error == 0)
+        {
+          r.size = r.stx.stx_size;
+          r.mtime = static_cast<int64_t>(r.stx.stx_mtime.tv_sec) * 1000000000 + r.stx.stx_mtime.tv_nsec;
+          if (r.size <= r.max_size && !r.source->maps(r.size))
+          {
+            auto& read = ring.prepare(IORING_OP_READ, r.fd, i * 2);
+            read.addr = reinterpret_cast<uint64_t>(r.source->buffer_for(r.size));
+            read.len = static_cast<uint32_t>(r.size);
+            // Hard, so that the close still runs if the read fails.
+            read.flags = IOSQE_IO_HARDLINK;
+          }
+        }
+        ring.prepare(IORING_OP_CLOSE, r.fd, i * 2 + 1);
+      }
+      ok = ring.submit_and_wait([&requests](uint64_t user_data, int res)
+      {
+        auto& r = requests[user_data / 2];
+        if (user_data % 2 != 0)
+        {
+          r.fd = -1;
+          return;
+        }
+        if (res < 0)
+          r.error = -res;
+        else if (static_cast<uint64_t>(res) == r.size)
+        {
+          r.read = true;
+          r.data = r.source->view(r.size);
+        }
+        // A short read leaves the book for the caller to read again.
+      });
+      return ok || close_all(requests);
+    }
+
+  private:
+    // Closes what a failed batch left open, and fails.
+    static bool close_all(std::span<ReadRequest> requests)
+    {
+      for (auto&& r : requests)
+      {
+        if (r.fd >= 0)
+          close(r.fd);
+        r.fd = -1;
+      }
+      return false;
+    }
+  };
+}
+#endif
+#endif
@@ -0,0 +1,244 @@
+#ifndef TXTFST_UTF8_H
+#define TXTFST_UTF8_H
+#pragma once
+
+#include <string_view>
+#include <vector>
+#include <tuple>
+#include <cstring>
+#include <cstdint>
+
+#ifdef __SSSE3__
+#include <immintrin.h>
+#endif
+
+namespace txtfst
+{
+  namespace details
+  {
+    // The length of the well-formed sequence at `p`, and whether it is one.
+    // An ill-formed sequence is as long as its maximal subpart (Unicode 3.9),
+    // so overlongs, surrogates and codepoints above U+10FFFF are rejected at
+    // the first byte that rules them out.
+    inline std::tuple<size_t, bool> utf8_sequence(const unsigned char* p, size_t size)
+    {
+      auto c = p[0];
+      if (c < 0x80)
+        return {1, true};
+
+      size_t len;
+      unsigned char lo = 0x80, hi = 0xBF; // the range of the second byte
+      if (c >= 0xC2 && c <= 0xDF)
+        len = 2;
+      else if (c >= 0xE0 && c <= 0xEF)
+      {
+        len = 3;
+        if (c == 0xE0) lo = 0xA0;
+        else if (c == 0xED) hi = 0x9F;
+      }
+      else if (c >= 0xF0 && c <= 0xF4)
+      {
+        len = 4;
+        if (c == 0xF0) lo = 0x90;
+        else if (c == 0xF4) hi = 0x8F;
+      }
+      else
+        return {1, false};
+
+      if (size < 2 || p[1] < lo || p[1] > hi)
+        return {1, false};
+      for (size_t i = 2; i < len; ++i)
+      {
+        if (i >= size || (p[i] & 0b11000000) != 0b10000000)
+          return {i, false};
+      }
+      return {len, true};
+    }
+
+    // How many bytes at the end of `text` start a sequence that continues
+    // past it, so that a reader working in blocks can hold them back.
+    inline size_t utf8_incomplete_tail(const char* text, size_t size)
+    {
+      for (size_t k = 1; k <= 3 && k <= size; ++k)
+      {
+        auto c = static_cast<unsigned char>(text[size - k]);
+        if ((c & 0b11000000) == 0b10000000)
+          continue;
+        size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return len > k ? k : 0;
+      }
+      return 0;
+    }
+
+#ifdef __SSSE3__
+    // The lookup algorithm of Keiser and Lemire, as used by simdjson and
+    // simdutf. Each byte is classified by the high nibble of the byte before
+    // it, the low nibble of the byte before it, and its own high nibble; a
+    // bit survives the AND of the three lookups only for an error.
+    namespace utf8_lookup
+    {
+      constexpr uint8_t too_short = 1 << 0; // a lead byte not followed by enough continuations
+      constexpr uint8_t too_long = 1 << 1; // a continuation after ASCII
+      constexpr uint8_t overlong_3 = 1 << 2;
+      constexpr uint8_t too_large = 1 << 3;
+      constexpr uint8_t surrogate = 1 << 4;
+      constexpr uint8_t overlong_2 = 1 << 5;
+      constexpr uint8_t too_large_1000 = 1 << 6;
+      constexpr uint8_t overlong_4 = 1 << 6;
+      constexpr uint8_t two_conts = 1 << 7; // a continuation after a continuation
+      constexpr uint8_t carry = too_short | too_long | two_conts;
+
+      inline __m128i table(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3, uint8_t a4, uint8_t a5, uint8_t a6,
+                           uint8_t a7, uint8_t a8, uint8_t a9, uint8_t a10, uint8_t a11, uint8_t a12,
+                           uint8_t a13, uint8_t a14, uint8_t a15)
+      {
+        return _mm_setr_epi8(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15);
+      }
+
+      inline __m128i high_nibble(__m128i v)
+      {
+        return _mm_and_si128(_mm_srli_epi16(v, 4), _mm_set1_epi8(0x0F));
+      }
+
+      inline __m128i check_special(__m128i input, __m128i prev1)
+      {
+        const auto byte_1_high = table(
+          too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+          two_conts, two_conts, two_conts, two_conts,
+          too_short | overlong_2,
+          too_short,
+          too_short | overlong_3 | surrogate,
+          too_short | too_large | too_large_1000 | overlong_4);
+        const auto byte_1_low = table(
+          carry | overlong_3 | overlong_2 | overlong_4,
+          carry | overlong_2,
+          carry, carry,
+          carry | too_large,
+          carry | too_large | too_large_1000,
+          carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+          carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+          carry | too_large | too_large_1000, carry | too_large | too_large_1000,
+          carry | too_large | too_large_1000,
+          carry | too_large | too_large_1000 | surrogate,
+          carry | too_large | too_large_1000, carry | too_large | too_large_1000);
+        const auto byte_2_high = table(
+          too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+          too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+          too_long | overlong_2 | two_conts | overlong_3 | too_large,
+          too_long | overlong_2 | two_conts | surrogate | too_large,
+          too_long | overlong_2 | two_conts | surrogate | too_large,
+          too_short, too_short, too_short, too_short);
+
+        auto a = _mm_shuffle_epi8(byte_1_high, high_nibble(prev1));
+        auto b = _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, _mm_set1_epi8(0x0F)));
+        auto c = _mm_shuffle_epi8(byte_2_high, high_nibble(input));
+        return _mm_and_si128(_mm_and_si128(a, b), c);
+      }
+
+      // The third and fourth bytes of a sequence must be continuations,
+      // which the lookup above can't see, and nothing else may be.
+      inline __m128i check_block(__m128i input, __m128i prev_input)
+      {
+        auto prev1 = _mm_alignr_epi8(input, prev_input, 15);
+        auto prev2 = _mm_alignr_epi8(input, prev_input, 14);
+        auto prev3 = _mm_alignr_epi8(input, prev_input, 13);
+        auto special = check_special(input, prev1);
+        auto third = _mm_subs_epu8(prev2, _mm_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+        auto fourth = _mm_subs_epu8(prev3, _mm_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+        auto must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8(static_cast<char>(0x80)));
+        return _mm_xor_si128(must23, special);
+      }
+
+      // Non-zero if the block ends in the middle of a sequence.
+      inline __m128i incomplete(__m128i input)
+      {
+        const auto max = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                       static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1),
+                                       static_cast<char>(0xC0 - 1));
+        return _mm_subs_epu8(input, max);
+      }
+    }
+#endif
+  }
+
+  // Whether `text` is well-formed UTF-8.
+  inline bool is_valid_utf8(std::string_view text)
+  {
+#ifdef __SSSE3__
+    using namespace details::utf8_lookup;
+    auto error = _mm_setzero_si128();
+    auto prev_input = _mm_setzero_si128();
+    auto prev_incomplete = _mm_setzero_si128();
+    auto check = [&](__m128i input)
+    {
+      if (_mm_movemask_epi8(input) == 0)
+      {
+        // ASCII can only be wrong if the previous block ended too early.
+        error = _mm_or_si128(error, prev_incomplete);
+      }
+      else
+      {
+        error = _mm_or_si128(error, check_block(input, prev_input));
+        prev_incomplete = incomplete(input);
+      }
+      prev_input = input;
+    };
+    size_t i = 0;
+    for (; i + 16 <= text.size(); i += 16)
+      check(_mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i)));
+    if (i < text.size())
+    {
+      char tail[16]{};
+      std::memcpy(tail, text.data() + i, text.size() - i);
+      check(_mm_loadu_si128(reinterpret_cast<const __m128i*>(tail)));
+    }
+    error = _mm_or_si128(error, prev_incomplete);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+#else
+    auto p = reinterpret_cast<const unsigned char*>(text.data());
+    for (size_t i = 0; i < text.size();)
+    {
+      if (i + 8 <= text.size())
+      {
+        uint64_t word;
+        std::memcpy(&word, p + i, sizeof(uint64_t));
+        if ((word & 0x8080808080808080ull) == 0)
+        {
+          i += 8;
+          continue;
+        }
+      }
+      auto [len, valid] = details::utf8_sequence(p + i, text.size() - i);
+      if (!valid)
+        return false;
+      i += len;
+    }
+    return true;
+#endif
+  }
+
+  // Removes the ill-formed sequences of `text`, moving the rest forward, and
+  // records where each one started, offset by `base`. Returns the new size.
+  // Well-formed text, the common case, is only read.
+  inline size_t drop_invalid_utf8(char* text, size_t size, size_t base, std::vector<size_t>& errors)
+  {
+    if (is_valid_utf8({text, size}))
+      return size;
+    auto p = reinterpret_cast<unsigned char*>(text);
+    size_t out = 0;
+    for (size_t i = 0; i < size;)
+    {
+      auto [len, valid] = details::utf8_sequence(p + i, size - i);
+      if (valid)
+      {
+        std::memmove(p + out, p + i, len);
+        out += len;
+      }
+      else
+        errors.emplace_back(base + i);
+      i += len;
+    }
+    return out;
+  }
+}
+#endif
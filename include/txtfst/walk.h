@@ -0,0 +1,126 @@
+#ifndef TXTFST_WALK_H
+#define TXTFST_WALK_H
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <functional>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+namespace txtfst
+{
+  namespace details
+  {
+    struct DirFd
+    {
+      int fd;
+
+      explicit DirFd(int fd_) : fd(fd_)
+      {
+      }
+
+      DirFd(const DirFd&) = delete;
+      DirFd& operator=(const DirFd&) = delete;
+
+      ~DirFd()
+      {
+        close(fd);
+      }
+    };
+
+    struct Walk
+    {
+      ThreadPool& pool;
+      std::string extension;
+      std::function<void(std::string)> on_file;
+      std::function<void(const std::string&)> on_error;
+
+      // Each directory is a task of its own, opened relative to its parent,
+      // which stays open until all of its subdirectories are. Entries are
+      // read with getdents64 and told apart by their d_type, so a file is
+      // only stat'ed when it is a symlink or the file system doesn't say.
+      void directory(const std::shared_ptr<Walk>& self, const std::shared_ptr<DirFd>& parent,
+                     const std::string& name, const std::string& path)
+      {
+        int fd = openat(parent == nullptr ? AT_FDCWD : parent->fd, name.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+        {
+          on_error(path);
+          return;
+        }
+        auto dir = std::make_shared<DirFd>(fd);
+        std::string prefix = path;
+        if (!prefix.empty() && prefix.back() != '/')
+          prefix += '/';
+
+        alignas(dirent64) char buffer[32768];
+        while (true)
+        {
+          auto n = getdents64(fd, buffer, sizeof(buffer));
+          if (n < 0)
+            on_error(path);
+          if (n <= 0)
+            break;
+          for (ssize_t pos = 0; pos < n;)
+          {
+            auto entry = reinterpret_cast<dirent64*>(buffer + pos);
+            pos += entry->d_reclen;
+            std::string_view entry_name = entry->d_name;
+            if (entry_name == "." || entry_name == "..")
+              continue;
+
+            auto type = entry->d_type;
+            if (type == DT_UNKNOWN || type == DT_LNK)
+            {
+              // Like std::filesystem, symlinks to files are followed, but
+              // symlinks to directories are not.
+              struct stat st{};
+              if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+              if (S_ISLNK(st.st_mode))
+                type = fstatat(fd, entry->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+              else if (S_ISDIR(st.st_mode))
+                type = DT_DIR;
+              else if (S_ISREG(st.st_mode))
+                type = DT_REG;
+            }
+
+            if (type == DT_DIR)
+            {
+              pool.submit([self, dir, name = std::string(entry_name), path = prefix + entry->d_name](size_t)
+              {
+                self->directory(self, dir, name, path);
+              });
+            }
+            else if (type == DT_REG && entry_name.size() > extension.size() && entry_name.ends_with(extension))
+              on_file(prefix + entry->d_name);
+          }
+        }
+      }
+    };
+  }
+
+  // Walks the tree under `root` on the threads of `pool`, calling
+  // `on_file(path)` for each regular file named *`extension` and
+  // `on_error(path)` for each directory that can't be read. Both are called
+  // concurrently, and the walk is done once `pool.wait()` returns. Paths
+  // start with `root`, as std::filesystem::recursive_directory_iterator
+  // would give them, but come in no particular order.
+  inline void walk_directory(ThreadPool& pool, const std::string& root, std::string_view extension,
+                             std::function<void(std::string)> on_file,
+                             std::function<void(const std::string&)> on_error)
+  {
+    auto walk = std::make_shared<details::Walk>(pool, std::string(extension), std::move(on_file),
+                                                std::move(on_error));
+    pool.submit([walk, root](size_t) { walk->directory(walk, nullptr, root, root); });
+  }
+}
+#endif
@@ -0,0 +1,123 @@
+#ifndef TXTFST_WRITER_H
+#define TXTFST_WRITER_H
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include <unistd.h>
+
+namespace txtfst
+{
+  // Appends to a vector, for callers that still want the segment in memory.
+  struct VectorWriter
+  {
+    std::vector<char>& out;
+
+    void write(const void* data, size_t size)
+    {
+      out.insert(out.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+    }
+
+    bool flush()
+    {
+      return true;
+    }
+  };
+
+  // Writes into memory that has already been sized by the caller.
+  struct BufferWriter
+  {
+    char* dest;
+
+    void write(const void* data, size_t size)
+    {
+      if (size == 0) return;
+      std::memcpy(dest, data, size);
+      dest += size;
+    }
+
+    bool flush()
+    {
+      return true;
+    }
+  };
+
+  // Writes sequentially into a region of a file starting at `offset` through a
+  // fixed-size buffer, so the region can be filled without holding it in memory.
+  // pwrite() doesn't move the file position, so writers covering disjoint
+  // regions of the same fd may run on different threads.
+  class FileWriter
+  {
+    int fd;
+    off_t offset;
+    std::vector<char> buffer;
+    size_t used{0};
+    bool good{true};
+
+  public:
+    explicit FileWriter(int fd_, off_t offset_, size_t buffer_size = 1 << 20)
+      : fd(fd_), offset(offset_)
+    {
+      buffer.resize(buffer_size);
+    }
+
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    ~FileWriter()
+    {
+      flush();
+    }
+
+    void write(const void* data, size_t size)
+    {
+      auto src = static_cast<const char*>(data);
+      if (size == 0) return;
+      if (size >= buffer.size())
+      {
+        flush();
+        write_through(src, size);
+        return;
+      }
+      if (buffer.size() - used < size)
+        flush();
+      std::memcpy(buffer.data() + used, src, size);
+      used += size;
+    }
+
+    bool flush()
+    {
+      if (used != 0)
+      {
+        write_through(buffer.data(), used);
+        used = 0;
+      }
+      return good;
+    }
+
+    [[nodiscard]] bool ok() const
+    {
+      return good;
+    }
+
+  private:
+    void write_through(const char* data, size_t size)
+    {
+      while (size != 0 && good)
+      {
+        auto written = pwrite(fd, data, size, offset);
+        if (written <= 0)
+        {
+          good = false;
+          break;
+        }
+        data += written;
+        size -= written;
+        offset += written;
+      }
+    }
+  };
+}
+#endif
@@ -1,12 +1,31 @@
 #include <iostream>
+#include <fstream>
 #include <filesystem>
+#include <unordered_set>
+#include <map>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 
 #include "txtfst/tokenizer.h"
 #include "txtfst/index.h"
 #include "txtfst/fst.h"
+#include "txtfst/dict.h"
+#include "txtfst/writer.h"
+#include "txtfst/hash.h"
+#include "txtfst/source.h"
+#include "txtfst/queue.h"
+#include "txtfst/uring.h"
+#include "txtfst/pool.h"
+#include "txtfst/walk.h"
+#include "txtfst/manifest.h"
+#include "txtfst/journal.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 void print_usage(char** argv)
 {
@@ -14,8 +33,158 @@ void print_usage(char** argv)
   std::println(std::cerr, "Options:");
   std::println(std::cerr, "   -n, --no-check            Enable unchecked tokenizer", argv[0]);
   std::println(std::cerr, "   -f, --filiter [num]       Drop tokens whose length < [num]", argv[0]);
-  std::println(std::cerr, "   -j, --jobs [num]          Start n jobs, defaults to be 1", argv[0]);
+  std::println(std::cerr, "   -j, --jobs [num]          Tokenize books with n threads, defaults to be 1", argv[0]);
+  std::println(std::cerr, "   -r, --readers [num]       Walk the library and read books ahead with n threads, defaults to be 1", argv[0]);
+  std::println(std::cerr, "   -e, --inverters [num]     Add books to chunks with n threads, defaults to be 1", argv[0]);
+  std::println(std::cerr, "   -o, --writers [num]       Write n chunks at a time, defaults to be 1", argv[0]);
   std::println(std::cerr, "   -c, --chunk [num]         Set chunk size, defaults to be 5000", argv[0]);
+  std::println(std::cerr, "   -m, --memory-budget [size] Also end chunks once those not yet written take about [size]", argv[0]);
+  std::println(std::cerr, "   -d, --dict                Build a global dictionary across chunks", argv[0]);
+  std::println(std::cerr, "   -s, --serialize-jobs [num] Build and serialize each chunk with n threads, defaults to be 1", argv[0]);
+  std::println(std::cerr, "   -i, --impact [title|content] Sort books of each token by its frequency", argv[0]);
+  std::println(std::cerr, "   -u, --update              Reuse the unchanged books of an existing index", argv[0]);
+  std::println(std::cerr, "   -b, --buffer [size]       Read books larger than [size] in blocks of [size], defaults to be 64M", argv[0]);
+  std::println(std::cerr, "   -w, --stopwords [path]    Drop the words listed in [path], or common English words with 'default'", argv[0]);
+  std::println(std::cerr, "   -D, --deterministic       Give the same index for the same books, with one inverter", argv[0]);
+  std::println(std::cerr, "   -R, --resume              Keep the chunks journaled by a build that stopped, and build the rest", argv[0]);
+}
+
+// A positive number of threads.
+bool parse_count(const std::string& str, size_t& count)
+{
+  size_t pos = 0;
+  try
+  {
+    count = std::stoul(str, &pos);
+  }
+  catch (...)
+  {
+    return false;
+  }
+  return pos == str.size() && count != 0;
+}
+
+// A number of bytes, optionally followed by K, M or G.
+bool parse_size(const std::string& str, size_t& size)
+{
+  size_t pos = 0;
+  try
+  {
+    size = std::stoul(str, &pos);
+  }
+  catch (...)
+  {
+    return false;
+  }
+  if (pos == str.size())
+    return true;
+  if (pos + 1 != str.size())
+    return false;
+  switch (std::toupper(str[pos]))
+  {
+    case 'K':
+      size <<= 10;
+      return true;
+    case 'M':
+      size <<= 20;
+      return true;
+    case 'G':
+      size <<= 30;
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool stat_book(const std::string& path, txtfst::BookMeta& meta)
+{
+  struct stat statbuf{};
+  if (stat(path.c_str(), &statbuf) != 0)
+    return false;
+  meta.size = statbuf.st_size;
+  meta.mtime = static_cast<int64_t>(statbuf.st_mtim.tv_sec) * 1000000000 + statbuf.st_mtim.tv_nsec;
+  return true;
+}
+
+bool hash_book(txtfst::DocumentSource& source, const std::string& path, uint64_t& hash)
+{
+  std::string_view data;
+  if (!source.open(path, data))
+    return false;
+  hash = txtfst::xxh64(data);
+  source.release();
+  return true;
+}
+
+// Reads back a region of the index being written, to checksum it as it is
+// on disk.
+bool hash_region(int fd, off_t offset, uint64_t size, uint64_t& hash)
+{
+  txtfst::Xxh64 hasher;
+  std::vector<char> buffer(std::min<uint64_t>(size, 1 << 20));
+  while (size != 0)
+  {
+    auto n = pread(fd, buffer.data(), std::min<uint64_t>(size, buffer.size()), offset);
+    if (n <= 0)
+      return false;
+    hasher.update({buffer.data(), static_cast<size_t>(n)});
+    offset += n;
+    size -= n;
+  }
+  hash = hasher.digest();
+  return true;
+}
+
+// A path from the walk, numbered in the order the readers get it.
+struct FoundPath
+{
+  size_t seq{0};
+  std::string path;
+};
+
+// A book on its way through the build pipeline.
+struct Document
+{
+  size_t seq{0};
+  std::string path;
+  txtfst::BookMeta meta;
+  bool streamed{false};
+  bool ok{false};
+  std::string_view data; // held by `book.source` until the book is counted
+  txtfst::BookView book;
+  txtfst::TermArena terms{256}; // the book's own, so tokenizers need no builder
+};
+
+// A chunk on its way from an inverter to a writer.
+struct FullBuilder
+{
+  std::unique_ptr<txtfst::IndexBuilder> builder;
+  size_t bytes{0}; // its estimate, counted against --memory-budget until it is written
+};
+
+bool build_dictionary(const std::string& path_to_index, const std::string& path_to_dict, size_t jobs)
+{
+  int fd = open(path_to_index.c_str(), O_RDONLY);
+  struct stat statbuf{};
+  if (fd < 0 || fstat(fd, &statbuf) != 0)
+    return false;
+  auto ptr = static_cast<char*>(mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0));
+  close(fd);
+  if (ptr == MAP_FAILED)
+    return false;
+  std::string_view indexdata{ptr, static_cast<size_t>(statbuf.st_size)};
+
+  txtfst::DictionaryBuilder builder;
+  for (auto&& segment : txtfst::segment_data(indexdata, txtfst::read_manifest(indexdata)))
+    builder.add_segment(txtfst::IndexView{segment});
+  auto dict = builder.build(indexdata.size(), jobs).compile();
+  munmap(ptr, statbuf.st_size);
+
+  std::ofstream ofs(path_to_dict, std::ios::binary);
+  if (ofs.fail())
+    return false;
+  ofs.write(dict.data(), static_cast<std::streamsize>(dict.size()));
+  return !ofs.fail();
 }
 
 int main(int argc, char** argv)
@@ -32,7 +201,20 @@ int main(int argc, char** argv)
   bool use_checked_tokenizer = true;
   int filter = -1;
   size_t build_worker = 0;
+  size_t readers = 1;
+  size_t inverters = 1;
+  size_t writers = 1;
   size_t chunk_size = 5000;
+  size_t memory_budget = 0;
+  bool build_dict = false;
+  size_t serialize_jobs = 1;
+  txtfst::ImpactOrder impact = txtfst::ImpactOrder::None;
+  bool update = false;
+  size_t buffer_size = size_t{1} << 26;
+  txtfst::Stopwords stopwords;
+  bool use_stopwords = false;
+  bool deterministic = false;
+  bool resume = false;
 
   if (argc > 3)
   {
@@ -86,6 +268,33 @@ int main(int argc, char** argv)
         }
         ++i;
       }
+      else if (options[i] == "-r" || options[i] == "--readers")
+      {
+        if (i + 1 >= options.size() || !parse_count(options[i + 1], readers))
+        {
+          std::println(std::cerr, "Expected a non-zero positive number after '{}'.", options[i]);
+          return -1;
+        }
+        ++i;
+      }
+      else if (options[i] == "-e" || options[i] == "--inverters")
+      {
+        if (i + 1 >= options.size() || !parse_count(options[i + 1], inverters))
+        {
+          std::println(std::cerr, "Expected a non-zero positive number after '{}'.", options[i]);
+          return -1;
+        }
+        ++i;
+      }
+      else if (options[i] == "-o" || options[i] == "--writers")
+      {
+        if (i + 1 >= options.size() || !parse_count(options[i + 1], writers))
+        {
+          std::println(std::cerr, "Expected a non-zero positive number after '{}'.", options[i]);
+          return -1;
+        }
+        ++i;
+      }
       else if (options[i] == "-c" || options[i] == "--chunk")
       {
         if (i + 1 >= options.size())
@@ -105,10 +314,114 @@ int main(int argc, char** argv)
         }
         ++i;
       }
+      else if (options[i] == "-s" || options[i] == "--serialize-jobs")
+      {
+        if (i + 1 >= options.size())
+        {
+          std::println(std::cerr, "Expected a number after '{}'.", options[i]);
+          return -1;
+        }
+        try
+        {
+          if(int a = std::stoi(options[i + 1]); a <= 0)
+          {
+            std::println(std::cerr, "Expected a non-zero positive number after '{}', found '{}'.",
+             options[i], options[i + 1]);
+            return -1;
+          }
+          else
+            serialize_jobs = a;
+        }
+        catch (...)
+        {
+          std::println(std::cerr, "Expected a number after '{}', found '{}'.",
+                       options[i], options[i + 1]);
+          return -1;
+        }
+        ++i;
+      }
+      else if (options[i] == "-i" || options[i] == "--impact")
+      {
+        if (i + 1 >= options.size())
+        {
+          std::println(std::cerr, "Expected 'title' or 'content' after '{}'.", options[i]);
+          return -1;
+        }
+        if (options[i + 1] == "title")
+          impact = txtfst::ImpactOrder::Title;
+        else if (options[i + 1] == "content")
+          impact = txtfst::ImpactOrder::Content;
+        else
+        {
+          std::println(std::cerr, "Expected 'title' or 'content' after '{}', found '{}'.",
+                       options[i], options[i + 1]);
+          return -1;
+        }
+        ++i;
+      }
       else if (options[i] == "-n" || options[i] == "--no-check")
       {
         use_checked_tokenizer = false;
       }
+      else if (options[i] == "-d" || options[i] == "--dict")
+      {
+        build_dict = true;
+      }
+      else if (options[i] == "-u" || options[i] == "--update")
+      {
+        update = true;
+      }
+      else if (options[i] == "-b" || options[i] == "--buffer")
+      {
+        if (i + 1 >= options.size())
+        {
+          std::println(std::cerr, "Expected a size after '{}'.", options[i]);
+          return -1;
+        }
+        if (!parse_size(options[i + 1], buffer_size) || buffer_size == 0)
+        {
+          std::println(std::cerr, "Expected a non-zero size after '{}', found '{}'.", options[i], options[i + 1]);
+          return -1;
+        }
+        ++i;
+      }
+      else if (options[i] == "-m" || options[i] == "--memory-budget")
+      {
+        if (i + 1 >= options.size())
+        {
+          std::println(std::cerr, "Expected a size after '{}'.", options[i]);
+          return -1;
+        }
+        if (!parse_size(options[i + 1], memory_budget) || memory_budget == 0)
+        {
+          std::println(std::cerr, "Expected a non-zero size after '{}', found '{}'.", options[i], options[i + 1]);
+          return -1;
+        }
+        ++i;
+      }
+      else if (options[i] == "-D" || options[i] == "--deterministic")
+      {
+        deterministic = true;
+      }
+      else if (options[i] == "-R" || options[i] == "--resume")
+      {
+        resume = true;
+      }
+      else if (options[i] == "-w" || options[i] == "--stopwords")
+      {
+        if (i + 1 >= options.size())
+        {
+          std::println(std::cerr, "Expected a path or 'default' after '{}'.", options[i]);
+          return -1;
+        }
+        if (options[i + 1] != "default" && !stopwords.load(options[i + 1]))
+        {
+          std::println(std::cerr, "Failed to read stopwords from '{}'.", options[i + 1]);
+          return -1;
+        }
+        use_stopwords = true;
+        ++i;
+      }
       else
       {
         std::println(std::cerr, "Unknown option '{}'.", options[i]);
@@ -126,121 +439,691 @@ int main(int argc, char** argv)
     return -1;
   }
 
-  std::ofstream ofs(path_to_index, std::ios::binary);
-  if (ofs.fail())
+  // The index is written next to the old one and renamed over it at the
+  // end, so the old one stays usable, and readable by --update, meanwhile.
+  // The segments written so far are journaled next to it, along with the
+  // options that decide what goes into them, so that --resume only keeps
+  // segments built the same way. The index records them too, for --update.
+  const std::string path_to_tmp = path_to_index + ".tmp";
+  const std::string path_to_journal = path_to_index + ".journal";
+  // The stopwords are told apart by a digest of the words themselves, so
+  // that editing the list counts as another option.
+  std::string stopwords_digest = "none";
+  std::vector<std::string> stopword_list;
+  if (use_stopwords)
+  {
+    stopword_list = stopwords.list();
+    txtfst::Xxh64 hasher;
+    for (auto&& word : stopword_list)
+    {
+      hasher.update(word);
+      hasher.update("\n");
+    }
+    stopwords_digest = std::format("{:016x}", hasher.digest());
+  }
+  const std::string settings = std::format("{}\n{}\n{}\n{}\n{}", path_to_library, filter, use_checked_tokenizer,
+                                           static_cast<int>(impact), stopwords_digest);
+  std::vector<txtfst::JournalEntry> journaled;
+  if (resume && !txtfst::read_journal(path_to_journal, settings, journaled))
+  {
+    std::println(std::cout, "No build with these options to resume at '{}', building all the books.", path_to_tmp);
+    resume = false;
+  }
+  int index_fd = open(path_to_tmp.c_str(), resume ? O_RDWR | O_CREAT : O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (index_fd < 0)
   {
     std::println(std::cerr, "Failed to write index.");
     return -1;
   }
 
-  std::vector<std::string> pathes;
-  for (const auto& entry : std::filesystem::recursive_directory_iterator(library_path))
-    if (entry.is_regular_file() && entry.path().extension() == ".txt")
-      pathes.emplace_back(entry.path());
+  std::mutex output_mtx;
+  off_t index_end = 0; // guarded by output_mtx
+
+  std::atomic<bool> write_failed(false);
+  std::vector<txtfst::SegmentInfo> manifest; // guarded by output_mtx
+  std::condition_variable segment_turn;
+  size_t placed_segments = 0; // guarded by output_mtx
+  size_t next_segment = 0;
+
+  // Segments are journaled in the order of their tickets, so the journal
+  // always covers the start of the file; one that is done before those
+  // ahead of it waits in `finished`. The index is synced first, so no entry
+  // is on disk before its segment.
+  txtfst::Journal journal;
+  std::mutex journal_mtx;
+  std::map<size_t, txtfst::JournalEntry> finished; // guarded by journal_mtx
+  size_t journaled_segments = 0; // guarded by journal_mtx
+  bool journal_failed = false; // guarded by journal_mtx
+  auto journal_segment = [&](size_t ticket, txtfst::JournalEntry entry)
+  {
+    std::lock_guard l(journal_mtx);
+    if (journal_failed)
+      return;
+    finished.emplace(ticket, std::move(entry));
+    if (finished.begin()->first != journaled_segments)
+      return;
+    bool synced = fdatasync(index_fd) == 0;
+    for (auto it = finished.begin(); it != finished.end() && it->first == journaled_segments; ++journaled_segments)
+    {
+      if (!synced || !journal.append(it->second))
+      {
+        journal_failed = true;
+        std::lock_guard o(output_mtx);
+        std::println(std::cerr, "WARNING: Failed to write journal, this build can't be resumed.");
+        return;
+      }
+      it = finished.erase(it);
+    }
+  };
 
-  size_t chunk_perworker = 0;
-  if(build_worker != 0)
+  // Only the region is reserved under the lock, the segment itself is
+  // streamed into it straight from the builder. Regions are reserved in the
+  // order of `ticket`, so segments are laid out in the order the builders
+  // were filled, whichever writer finishes first.
+  auto write_segment = [&](txtfst::IndexBuilder& builder, size_t ticket)
   {
-    chunk_perworker = pathes.size() / chunk_size / build_worker;
-    while (chunk_perworker == 0 && build_worker > 1)
+    // The builder is emptied before the segment is serialized, so a chunk
+    // isn't held twice.
+    auto index = builder.build(serialize_jobs);
+    builder = txtfst::IndexBuilder{impact};
+    auto layout = index.layout();
+    uint64_t idx_size = layout.size();
+    txtfst::SegmentInfo info{
+      .size = idx_size, .books = index.book_paths.size(), .min_term = index.min_term, .max_term = index.max_term
+    };
+    off_t offset;
     {
-      --build_worker;
-      chunk_perworker = pathes.size() / chunk_size / build_worker;
+      std::unique_lock l(output_mtx);
+      segment_turn.wait(l, [&] { return placed_segments == ticket; });
+      offset = index_end;
+      index_end += static_cast<off_t>(sizeof(uint64_t) + idx_size);
+      info.offset = offset + sizeof(uint64_t);
+      manifest.emplace_back(info);
+      ++placed_segments;
     }
+    segment_turn.notify_all();
+
+    bool written = pwrite(index_fd, &idx_size, sizeof(uint64_t), offset) == sizeof(uint64_t);
+    offset += sizeof(uint64_t);
+    written = index.compile([offset, &index_fd](size_t pos) { return txtfst::FileWriter(index_fd, offset + pos); },
+                            layout, serialize_jobs) && written;
+    uint64_t checksum;
+    if (!written)
+      write_failed = true;
+    else if (hash_region(index_fd, offset, idx_size, checksum))
+      journal_segment(ticket, {std::move(info), checksum});
+  };
+
+
+  auto start = std::chrono::system_clock::now();
+
+  // The segments journaled by the build that stopped are kept as far as
+  // their bytes still match their checksums, and their books aren't read
+  // again. Whatever that build wrote after them is cut off. This and the
+  // journal are done before the walk starts, so failing here leaves no
+  // walker behind.
+  std::unordered_set<std::string> built;
+  if (resume)
+  {
+    struct stat statbuf{};
+    char* tmp_ptr = nullptr;
+    if (fstat(index_fd, &statbuf) == 0 && statbuf.st_size != 0)
+    {
+      tmp_ptr = static_cast<char*>(mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, index_fd, 0));
+      if (tmp_ptr == MAP_FAILED)
+        tmp_ptr = nullptr;
+    }
+
+    size_t kept = 0;
+    if (tmp_ptr != nullptr)
+    {
+      std::string_view tmpdata{tmp_ptr, static_cast<size_t>(statbuf.st_size)};
+      for (auto&& [segment, checksum] : journaled)
+      {
+        uint64_t size;
+        if (segment.offset != index_end + sizeof(uint64_t) || segment.offset + segment.size > tmpdata.size())
+          break;
+        std::memcpy(&size, tmpdata.data() + index_end, sizeof(uint64_t));
+        auto data = tmpdata.substr(segment.offset, segment.size);
+        if (size != segment.size || txtfst::xxh64(data) != checksum)
+          break;
+        txtfst::IndexView index(data);
+        for (size_t idx = 0; idx < index.books(); ++idx)
+          built.emplace(index.book_path(idx));
+        manifest.emplace_back(segment);
+        index_end = static_cast<off_t>(segment.offset + segment.size);
+        ++kept;
+      }
+      munmap(tmp_ptr, statbuf.st_size);
+    }
+    journaled.resize(kept);
+    placed_segments = next_segment = journaled_segments = kept;
+    if (ftruncate(index_fd, index_end) != 0)
+      write_failed = true;
+
+  }
+  bool journal_created = journal.create(path_to_journal, settings);
+  for (auto&& entry : journaled)
+    journal_created = journal_created && journal.append(entry);
+  if (!journal_created)
+  {
+    std::println(std::cerr, "Failed to write journal at '{}'.", path_to_journal);
+    return -1;
   }
 
-  std::vector<std::thread> workers;
-  workers.resize(build_worker);
-  std::vector<txtfst::IndexBuilder> builders;
-  builders.resize(build_worker + 1);
-  std::vector<size_t> curr_chunk;
-  curr_chunk.resize(build_worker + 1);
-  std::mutex output_mtx;
-  std::atomic<size_t> completed(0);
 
-  auto add_book = [&, total = pathes.size()]
-  (size_t worker_id, const std::string& path, txtfst::IndexBuilder& builder)
+  // The library is walked on the readers' count of threads, and the paths
+  // reach the readers as they are found, except with --update, which first
+  // needs all of them to tell which books are gone, --resume, which drops
+  // those already built, and --deterministic, which sorts them.
+  // The queue is declared first, so it outlives the walkers pushing to it.
+  txtfst::BoundedQueue<FoundPath> found_paths(4096);
+  std::atomic<size_t> found(0);
+  txtfst::ThreadPool walkers(readers);
+  auto walk_library = [&](std::function<void(std::string)> on_file)
   {
-    auto [title, content, errcnt]
-        = txtfst::tokenize_book(path, filter, use_checked_tokenizer);
-    if (errcnt == 1)
+    txtfst::walk_directory(walkers, path_to_library, ".txt", std::move(on_file), [&](const std::string& path)
     {
       std::lock_guard l(output_mtx);
-      std::println(std::cerr,
-                   "WARNING: In file '{}', {} invalid UTF-8 codepoint was ignored.",
-                   path, errcnt);
+      std::println(std::cerr, "WARNING: Failed to read directory '{}', skipped.", path);
+    });
+  };
+  std::vector<std::string> pathes;
+  if (update || resume || deterministic)
+  {
+    std::mutex pathes_mtx;
+    walk_library([&](std::string path)
+    {
+      std::lock_guard l(pathes_mtx);
+      pathes.emplace_back(std::move(path));
+    });
+    walkers.wait();
+  }
+  else
+  {
+    walk_library([&](std::string path)
+    {
+      found_paths.push({found++, std::move(path)});
+    });
+  }
+  if (resume)
+  {
+    std::erase_if(pathes, [&built](auto&& path) { return built.contains(path); });
+    std::println(std::cout, "Resumed {} books ({} chunks), {} books to build.", built.size(), manifest.size(),
+                 pathes.size());
+  }
+  // A book is unchanged if its size and mtime, or failing that its hash,
+  // match what the old index recorded. Segments whose books are all
+  // unchanged are copied as they are; the unchanged books of the others are
+  // moved into new segments from their postings. Only the rest is read.
+  if (update)
+  {
+    int old_fd = open(path_to_index.c_str(), O_RDONLY);
+    struct stat statbuf{};
+    char* old_ptr = nullptr;
+    if (old_fd >= 0 && fstat(old_fd, &statbuf) == 0 && statbuf.st_size != 0)
+    {
+      old_ptr = static_cast<char*>(mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, old_fd, 0));
+      if (old_ptr == MAP_FAILED)
+        old_ptr = nullptr;
+    }
+    if (old_fd >= 0)
+      close(old_fd);
+
+    // Books are only reused from an index built with the same options, or
+    // they would disagree with those built now.
+    if (old_ptr == nullptr)
+      std::println(std::cout, "No index to update at '{}', building all the books.", path_to_index);
+    else if (txtfst::read_settings({old_ptr, static_cast<size_t>(statbuf.st_size)}) != settings)
+    {
+      std::println(std::cout, "The index at '{}' was built with other options, building all the books.",
+                   path_to_index);
+      munmap(old_ptr, statbuf.st_size);
     }
-    else if (errcnt > 0)
+    else
+    {
+      std::string_view olddata{old_ptr, static_cast<size_t>(statbuf.st_size)};
+      std::unordered_set<std::string> current(pathes.begin(), pathes.end());
+      std::unordered_set<std::string> reused;
+      txtfst::IndexBuilder builder{impact};
+      txtfst::DocumentSource source;
+      size_t in_builder = 0, copied = 0;
+      for (auto&& segment : txtfst::read_manifest(olddata))
+      {
+        auto raw = olddata.substr(segment.offset - sizeof(uint64_t), segment.size + sizeof(uint64_t));
+        txtfst::IndexView index(raw.substr(sizeof(uint64_t)));
+        std::vector<std::pair<size_t, txtfst::BookMeta> > kept;
+        bool untouched = true;
+        for (size_t idx = 0; idx < index.books(); ++idx)
+        {
+          auto path = index.book_path(idx);
+          auto& old = index.book_meta(idx);
+          txtfst::BookMeta meta;
+          if (!current.contains(path) || !stat_book(path, meta) || meta.size != old.size)
+          {
+            untouched = false;
+            continue;
+          }
+          if (meta.mtime == old.mtime)
+          {
+            meta.hash = old.hash;
+            kept.emplace_back(idx, meta);
+            continue;
+          }
+          untouched = false;
+          if (hash_book(source, path, meta.hash) && meta.hash == old.hash)
+            kept.emplace_back(idx, meta);
+        }
+
+        if (untouched)
+        {
+          txtfst::SegmentInfo info{
+            .offset = index_end + sizeof(uint64_t), .size = raw.size() - sizeof(uint64_t), .books = index.books(),
+            .min_term = index.min_term, .max_term = index.max_term
+          };
+          if (pwrite(index_fd, raw.data(), raw.size(), index_end) != static_cast<ssize_t>(raw.size()))
+            write_failed = true;
+          else
+            journal_segment(next_segment, {info, txtfst::xxh64(raw.substr(sizeof(uint64_t)))});
+          manifest.emplace_back(std::move(info));
+          index_end += static_cast<off_t>(raw.size());
+          ++placed_segments;
+          ++next_segment;
+          for (size_t idx = 0; idx < index.books(); ++idx)
+            reused.emplace(index.book_path(idx));
+          ++copied;
+          continue;
+        }
+
+        if (kept.empty())
+          continue;
+        auto tokens = index.book_tokens();
+        for (auto&& [idx, meta] : kept)
+        {
+          auto path = index.book_path(idx);
+          builder.add_book(path, tokens[idx], meta);
+          reused.emplace(std::move(path));
+          if (++in_builder == chunk_size || (memory_budget != 0 && builder.memory() >= memory_budget))
+          {
+            write_segment(builder, next_segment++);
+            builder = txtfst::IndexBuilder{impact};
+            in_builder = 0;
+          }
+        }
+      }
+      if (in_builder != 0)
+        write_segment(builder, next_segment++);
+      munmap(old_ptr, statbuf.st_size);
+
+      std::erase_if(pathes, [&reused](auto&& path) { return reused.contains(path); });
+      std::println(std::cout, "Reused {} books ({} chunks unchanged), {} books to build.",
+                   reused.size(), copied, pathes.size());
+    }
+  }
+  if (update || resume || deterministic)
+  {
+    if (deterministic)
+      std::ranges::sort(pathes);
+    found = pathes.size();
+    walkers.submit([&](size_t)
+    {
+      for (size_t i = 0; i < pathes.size(); ++i)
+        found_paths.push({i, std::move(pathes[i])});
+    });
+  }
+
+  // Each stage of the build runs on threads of its own: readers open the
+  // books ahead of time, tokenizers count their tokens, inverters add them
+  // to chunk builders, and writers serialize the full builders. A fixed
+  // number of documents circulates from the readers to the inverters and
+  // back, so the readers can only run that far ahead, and inverters wait
+  // for the writers once a few builders are full.
+  const size_t tokenizers = build_worker + 1;
+  if (deterministic)
+    inverters = 1;
+#ifdef TXTFST_IO_URING
+  // Enough documents for every reader to have a batch in flight.
+  constexpr size_t read_batch = 64;
+#else
+  constexpr size_t read_batch = 1;
+#endif
+  const size_t depth = 2 * (readers + tokenizers + inverters) + readers * read_batch;
+  std::vector<std::unique_ptr<Document> > documents;
+  txtfst::BoundedQueue<Document*> free_docs(depth);
+  txtfst::BoundedQueue<Document*> read_docs(depth);
+  txtfst::BoundedQueue<Document*> counted_docs(depth);
+  txtfst::BoundedQueue<FullBuilder> full_builders(writers);
+  for (size_t i = 0; i < depth; ++i)
+  {
+    documents.emplace_back(std::make_unique<Document>());
+    free_docs.push(documents.back().get());
+  }
+  std::vector<txtfst::BookStream> streams;
+  for (size_t i = 0; i < tokenizers; ++i)
+    streams.emplace_back(buffer_size);
+  constexpr size_t max_reported_errors = 8;
+  const txtfst::Stopwords* dropped = use_stopwords ? &stopwords : nullptr;
+  std::atomic<size_t> completed(0);
+  // The estimated bytes of the builders that aren't written yet, whether
+  // they are being filled, queued or serialized. Only the writers lower it,
+  // under `budget_mtx`, and wake the inverters waiting for them.
+  std::atomic<size_t> building_bytes(0);
+  std::mutex budget_mtx;
+  std::condition_variable budget_freed;
+
+  std::vector<std::thread> threads;
+  threads.emplace_back([&]
+  {
+    walkers.wait();
+    found_paths.close();
+  });
+  // Starts `n` threads of `body(id)`. The last of them to return calls
+  // `done`, which closes the queue the stage feeds.
+  auto run_stage = [&threads](size_t n, auto body, auto done)
+  {
+    auto remaining = std::make_shared<std::atomic<size_t> >(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+      threads.emplace_back([i, remaining, body, done]
+      {
+        body(i);
+        if (--*remaining == 0)
+          done();
+      });
+    }
+  };
+
+  auto report_errors = [&](const Document& doc)
+  {
+    auto& errors = doc.book.error_offsets;
+    if (!doc.ok)
     {
       std::lock_guard l(output_mtx);
-      std::println(std::cerr,
-                   "WARNING: In file '{}', {} invalid UTF-8 codepoints were ignored.",
-                   path, errcnt);
+      std::println(std::cerr, "WARNING: Failed to read '{}', skipped.", doc.path);
     }
-    builder.add_book(path, title, content);
-    ++completed;
-    if (++curr_chunk[worker_id] == chunk_size)
+    else if (!errors.empty())
     {
-      auto idx = builder.build().compile();
-      uint64_t idx_size = idx.size();
-      output_mtx.lock();
-      ofs.write(reinterpret_cast<char*>(&idx_size), sizeof(uint64_t));
-      ofs.write(idx.data(), static_cast<std::streamsize>(idx.size()));
-      output_mtx.unlock();
-      builder = txtfst::IndexBuilder{};
-      curr_chunk[worker_id] = 0;
+      std::string offsets;
+      for (size_t i = 0; i < (std::min)(errors.size(), max_reported_errors); ++i)
+        offsets += std::format("{}, ", errors[i]);
+      offsets.resize(offsets.size() - 2);
+      if (errors.size() > max_reported_errors)
+        offsets += ", ...";
+      std::lock_guard l(output_mtx);
+      if (errors.size() == 1)
+        std::println(std::cerr, "WARNING: In file '{}', 1 invalid UTF-8 sequence at byte {} was ignored.",
+                     doc.path, offsets);
+      else
+        std::println(std::cerr, "WARNING: In file '{}', {} invalid UTF-8 sequences at bytes {} were ignored.",
+                     doc.path, errors.size(), offsets);
     }
-    output_mtx.lock();
-    std::print(std::cout, "\x1b[80D\x1b[K{}/{}", completed.load(), total);
-    output_mtx.unlock();
   };
 
   std::println(std::cout, "Start building index for '{}'.", path_to_library);
 
-  auto start = std::chrono::system_clock::now();
+  // Books too large to hold at once are read by the tokenizer a block at a
+  // time.
+  auto read_book = [&](Document* doc)
+  {
+    doc->meta = {};
+    stat_book(doc->path, doc->meta);
+    doc->streamed = doc->meta.size > buffer_size;
+    doc->ok = doc->streamed || doc->book.source.open(doc->path, doc->data);
+  };
+
+  // A reader takes a free document before the path it reads into it, so
+  // that every path taken already has a document to reach the inverters in.
+  // Without `wait`, only takes one if both are at hand.
+  auto take_path = [&](Document*& doc, bool wait)
+  {
+    if (wait)
+      free_docs.pop(doc);
+    else if (!free_docs.try_pop(doc))
+      return false;
+    FoundPath next;
+    if (wait ? !found_paths.pop(next) : !found_paths.try_pop(next))
+    {
+      free_docs.push(doc);
+      return false;
+    }
+    doc->seq = next.seq;
+    doc->path = std::move(next.path);
+    return true;
+  };
+
+  run_stage(readers, [&](size_t)
+  {
+    Document* doc;
+#ifdef TXTFST_IO_URING
+    // Waits for one free document, then takes as many more as are free, and
+    // reads them in one batch. Without a ring, e.g. on an old kernel, this
+    // falls back to reading one book at a time below.
+    txtfst::BatchReader batch_reader(read_batch);
+    if (batch_reader.ok())
+    {
+      std::vector<Document*> batch;
+      std::vector<txtfst::ReadRequest> requests;
+      while (take_path(doc, true))
+      {
+        batch.clear();
+        batch.emplace_back(doc);
+        while (batch.size() < batch_reader.batch_size() && take_path(doc, false))
+          batch.emplace_back(doc);
+
+        requests.assign(batch.size(), {});
+        for (size_t k = 0; k < batch.size(); ++k)
+        {
+          requests[k].path = &batch[k]->path;
+          requests[k].source = &batch[k]->book.source;
+          requests[k].max_size = buffer_size;
+        }
+        bool batched = batch_reader.read(requests);
+        for (size_t k = 0; k < batch.size(); ++k)
+        {
+          doc = batch[k];
+          auto& r = requests[k];
+          // Whatever went wrong in the batch, the book is read again
+          // without it, and only skipped if that fails too.
+          if (!batched || r.error != 0)
+            read_book(doc);
+          else
+          {
+            doc->meta = txtfst::BookMeta{r.size, r.mtime, 0};
+            doc->streamed = r.size > buffer_size;
+            if (r.read)
+            {
+              doc->data = r.data;
+              doc->ok = true;
+            }
+            else
+              doc->ok = doc->streamed || doc->book.source.open(doc->path, doc->data);
+          }
+          read_docs.push(doc);
+        }
+      }
+      return;
+    }
+#endif
+    while (take_path(doc, true))
+    {
+      read_book(doc);
+      read_docs.push(doc);
+    }
+  }, [&] { read_docs.close(); });
 
-  if (chunk_perworker != 0)
+  run_stage(tokenizers, [&](size_t id)
   {
-    for (size_t i = 0; i < build_worker; ++i)
+    Document* doc;
+    while (read_docs.pop(doc))
     {
-      workers[i] = std::thread{
-        [i, chunk_perworker, chunk_size, &add_book, &pathes, &builders]
+      auto& book = doc->book;
+      doc->terms.clear();
+      book.error_offsets.clear();
+      if (doc->streamed)
+      {
+        auto& stream = streams[id];
+        doc->ok = stream.open(doc->path);
+        if (doc->ok)
         {
-          for (size_t j = i * chunk_perworker * chunk_size; j < (i + 1) * chunk_perworker * chunk_size; ++j)
-            add_book(i, pathes[j], builders[i]);
+          book.counts.clear();
+          stream.tokenize(filter, dropped, use_checked_tokenizer, [doc](std::string_view token, bool title)
+          {
+            doc->book.counts.add(doc->terms.intern(token), title);
+          });
+          doc->meta.hash = stream.hash;
+          book.error_offsets.swap(stream.error_offsets);
         }
-      };
+      }
+      else if (doc->ok)
+      {
+        txtfst::count_book(doc->data, filter, use_checked_tokenizer, doc->terms, book, dropped);
+        book.source.release();
+        doc->meta.hash = book.hash;
+      }
+      report_errors(*doc);
+      counted_docs.push(doc);
     }
-  }
+  }, [&] { counted_docs.close(); });
 
-  if(build_worker * chunk_perworker * chunk_size < pathes.size())
+  run_stage(inverters, [&](size_t)
   {
-    for (size_t i = build_worker * chunk_perworker * chunk_size; i < pathes.size(); ++i)
-      add_book(build_worker, pathes[i], builders[build_worker]);
-    auto idx = builders[build_worker].build().compile();
-    uint64_t idx_size = idx.size();
-    output_mtx.lock();
-    ofs.write(reinterpret_cast<char*>(&idx_size), sizeof(uint64_t));
-    ofs.write(idx.data(), static_cast<std::streamsize>(idx.size()));
-    output_mtx.unlock();
-  }
+    auto builder = std::make_unique<txtfst::IndexBuilder>(impact);
+    size_t in_builder = 0, builder_bytes = 0;
+    auto invert = [&](Document* doc)
+    {
+      bool over_budget = false;
+      if (doc->ok)
+      {
+        builder->add_book(doc->path, doc->terms, doc->book.counts, doc->meta);
+        ++in_builder;
+        if (memory_budget != 0)
+        {
+          // The budget is shared, so whichever inverter goes over it ends
+          // its chunk, even if another's is larger. With --deterministic,
+          // chunks end by their own size only, as what the writers still
+          // hold depends on timing.
+          auto bytes = builder->memory();
+          auto shared = (building_bytes += bytes - builder_bytes);
+          over_budget = (deterministic ? bytes : shared) >= memory_budget;
+          builder_bytes = bytes;
+        }
+      }
+      free_docs.push(doc);
+      if (in_builder == chunk_size || over_budget)
+      {
+        full_builders.push({std::move(builder), builder_bytes});
+        builder = std::make_unique<txtfst::IndexBuilder>(impact);
+        in_builder = 0;
+        builder_bytes = 0;
+        // The next chunk would end as soon as it starts while the chunks
+        // the writers have yet to finish take most of the budget, so this
+        // waits until at least half of it is free again.
+        if (memory_budget != 0 && !deterministic)
+        {
+          std::unique_lock l(budget_mtx);
+          budget_freed.wait(l, [&] { return building_bytes <= memory_budget / 2; });
+        }
+      }
+      ++completed;
+      output_mtx.lock();
+      std::print(std::cout, "\x1b[80D\x1b[K{}/{}", completed.load(), found.load());
+      output_mtx.unlock();
+    };
+
+    // With --deterministic, the only inverter adds the books in the order of
+    // their paths, and holds back those that arrive early. Each of them has
+    // a document, so they are fewer than `depth` ahead.
+    std::vector<Document*> early(deterministic ? depth : 0, nullptr);
+    size_t next_seq = 0;
+    Document* doc;
+    while (counted_docs.pop(doc))
+    {
+      if (!deterministic)
+      {
+        invert(doc);
+        continue;
+      }
+      early[doc->seq % depth] = doc;
+      while ((doc = early[next_seq % depth]) != nullptr)
+      {
+        early[next_seq++ % depth] = nullptr;
+        invert(doc);
+      }
+    }
+    if (in_builder != 0)
+      full_builders.push({std::move(builder), builder_bytes});
+  }, [&] { full_builders.close(); });
 
-  if(chunk_perworker != 0)
+  // Builders are numbered as they are taken, under a lock, so in the order
+  // the inverters pushed them.
+  std::mutex take_mtx;
+  run_stage(writers, [&](size_t)
   {
-    for (size_t i = 0; i < build_worker; ++i)
+    FullBuilder full;
+    while (true)
     {
-      if (workers[i].joinable())
-        workers[i].join();
+      size_t ticket;
+      {
+        std::lock_guard l(take_mtx);
+        if (!full_builders.pop(full))
+          break;
+        ticket = next_segment++;
+      }
+      write_segment(*full.builder, ticket);
+      full.builder.reset();
+      if (full.bytes != 0)
+      {
+        {
+          std::lock_guard l(budget_mtx);
+          building_bytes -= full.bytes;
+        }
+        budget_freed.notify_all();
+      }
     }
+  }, [] {});
+
+  for (auto&& t : threads)
+    t.join();
+
+  std::print(std::cout, "\x1b[80D\x1b[K{}/{}\n", found.load(), found.load());
+
+  // Segments were placed in order, so the manifest already is.
+  uint64_t first_book = 0;
+  for (auto&& segment : manifest)
+  {
+    segment.first_book = first_book;
+    first_book += segment.books;
+  }
+  auto footer = txtfst::pack_manifest({settings, manifest, stopword_list});
+  if (pwrite(index_fd, footer.data(), footer.size(), index_end) != static_cast<ssize_t>(footer.size()))
+    write_failed = true;
+  close(index_fd);
+  if (write_failed || std::rename(path_to_tmp.c_str(), path_to_index.c_str()) != 0)
+  {
+    // What was journaled is kept for --resume.
+    std::println(std::cerr, "Failed to write index.");
+    return -1;
   }
+  std::error_code ec;
+  std::filesystem::remove(path_to_journal, ec);
 
-  std::print(std::cout, "\x1b[80D\x1b[K{}/{}\n", pathes.size(), pathes.size());
+  // A dictionary left by a previous build would point into the wrong segments.
+  const std::string path_to_dict = path_to_index + ".dict";
+  std::filesystem::remove(path_to_dict, ec);
+  if (build_dict)
+  {
+    std::println(std::cout, "Building global dictionary.");
+    if (!build_dictionary(path_to_index, path_to_dict, serialize_jobs))
+    {
+      std::println(std::cerr, "Failed to write dictionary.");
+      return -1;
+    }
+  }
 
   auto end = std::chrono::system_clock::now();
   std::println(std::cout, "Successfully built index at '{}', time: {} s", path_to_index,
                 static_cast<double>(std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count()) /
                 1000.0);
 
-  ofs.close();
   return 0;
 }
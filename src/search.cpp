@@ -3,12 +3,16 @@
 #include <thread>
 #include <mutex>
 #include <chrono>
+#include <numeric>
 
 #include "txtfst/index.h"
+#include "txtfst/dict.h"
+#include "txtfst/manifest.h"
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 void print_usage(char** argv)
 {
@@ -18,8 +22,25 @@ void print_usage(char** argv)
   std::println(std::cerr, "   -t, --title            Search in title");
   std::println(std::cerr, "   -c, --content          Search in content");
   std::println(std::cerr, "   -j, --jobs [num]       Start n jobs, defaults to be 1", argv[0]);
+  std::println(std::cerr, "   -a, --and              Find books containing all the tokens");
+  std::println(std::cerr, "   -o, --or               Find books containing any of the tokens");
+  std::println(std::cerr, "   -x, --exclude [token]  Drop books containing [token] with -a or -o");
+  std::println(std::cerr, "   -k, --top [num]        Show only the n books with the highest frequency");
+  std::println(std::cerr, "   -s, --substring        Find books containing a token that contains the tokens");
 }
 
+struct RankedBook
+{
+  size_t freq{0};
+  size_t segment{0};
+  size_t idx{0};
+};
+
+enum class Query
+{
+  Each, And, Or
+};
+
 int main(int argc, char** argv)
 {
   if (argc < 4)
@@ -32,11 +53,19 @@ int main(int argc, char** argv)
 
   bool search_title = false;
   size_t search_worker = 0;
+  Query query = Query::Each;
+  std::vector<std::string> excluded;
+  size_t top_k = 0;
+  bool substring = false;
+  auto takes_value = [](std::string_view opt)
+  {
+    return opt == "-j" || opt == "--jobs" || opt == "-x" || opt == "--exclude" || opt == "-k" || opt == "--top";
+  };
   std::vector<std::string> options;
   size_t argpos = 2;
   for (; argpos < argc; ++argpos)
   {
-    if(argv[argpos][0] != '-' && argv[argpos - 1][1] != 'j') break;
+    if(argv[argpos][0] != '-' && !takes_value(argv[argpos - 1])) break;
     options.emplace_back(argv[argpos]);
   }
   for (size_t i = 0; i < options.size(); ++i)
@@ -74,6 +103,49 @@ int main(int argc, char** argv)
       }
       ++i;
     }
+    else if (options[i] == "-k" || options[i] == "--top")
+    {
+      if (i + 1 >= options.size())
+      {
+        std::println(std::cerr, "Expected a number after '{}'.", options[i]);
+        return -1;
+      }
+      try
+      {
+        top_k = std::stoul(options[i + 1]);
+      }
+      catch (...)
+      {
+        std::println(std::cerr, "Expected a number after '{}', found '{}'.",
+                     options[i], options[i + 1]);
+        return -1;
+      }
+      ++i;
+    }
+    else if (options[i] == "-s" || options[i] == "--substring")
+    {
+      substring = true;
+    }
+    else if (options[i] == "-a" || options[i] == "--and")
+    {
+      query = Query::And;
+    }
+    else if (options[i] == "-o" || options[i] == "--or")
+    {
+      query = Query::Or;
+    }
+    else if (options[i] == "-x" || options[i] == "--exclude")
+    {
+      if (i + 1 >= options.size())
+      {
+        std::println(std::cerr, "Expected a token after '{}'.", options[i]);
+        return -1;
+      }
+      excluded.emplace_back();
+      for (auto&& ch : options[i + 1])
+        excluded.back() += static_cast<char>(std::tolower(ch));
+      ++i;
+    }
     else
     {
       std::println(std::cerr, "Unknown option '{}'.", options[i]);
@@ -91,6 +163,30 @@ int main(int argc, char** argv)
   }
   tokens.pop_back();
 
+  if (tokens.empty())
+  {
+    print_usage(argv);
+    return -1;
+  }
+
+  if (query == Query::Each && !excluded.empty())
+  {
+    std::println(std::cerr, "'-x' requires '-a' or '-o'.");
+    return -1;
+  }
+
+  if (query != Query::Each && top_k != 0)
+  {
+    std::println(std::cerr, "'-k' can't be used with '-a' or '-o'.");
+    return -1;
+  }
+
+  if (substring && (query != Query::Each || top_k != 0))
+  {
+    std::println(std::cerr, "'-s' can't be used with '-a', '-o' or '-k'.");
+    return -1;
+  }
+
   std::println(std::cout, "Loading index from '{}'.", path_to_index);
 
   auto start = std::chrono::system_clock::now();
@@ -105,32 +201,186 @@ int main(int argc, char** argv)
   auto ptr = static_cast<char*>(mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0));
   std::string_view indexdata{ptr, static_cast<size_t>(statbuf.st_size)};
 
-  std::vector<std::string_view> packed;
-  for (size_t i = 0; i < indexdata.size();)
+  auto packed = txtfst::segment_data(indexdata, txtfst::read_manifest(indexdata));
+
+  // Words the build dropped with -w are in no book, so with -a they would
+  // empty the result and with -x they would exclude nothing. They are left
+  // out of the query instead.
+  if (query != Query::Each)
   {
-    uint64_t size;
-    std::memcpy(&size, indexdata.data() + i, sizeof(uint64_t));
-    packed.emplace_back(indexdata.substr(i + sizeof(uint64_t), size));
-    i += size + sizeof(uint64_t);
+    auto stopwords = txtfst::read_stopwords(indexdata);
+    auto drop_stopwords = [&stopwords](std::vector<std::string>& list)
+    {
+      std::erase_if(list, [&stopwords](const std::string& token)
+      {
+        if (!std::ranges::binary_search(stopwords, token))
+          return false;
+        std::println(std::cerr, "WARNING: '{}' is a stopword of this index, dropped from the query.", token);
+        return true;
+      });
+    };
+    drop_stopwords(tokens);
+    drop_stopwords(excluded);
+    if (tokens.empty())
+    {
+      std::println(std::cerr, "All the tokens are stopwords of this index.");
+      exit(-1);
+    }
   }
 
-  std::mutex add_mtx;
-  size_t work_perworker = 0;
-  if(search_worker != 0)
+  // Use the global dictionary if the index was built with one, so that
+  // only the segments containing a token are visited.
+  const std::string path_to_dict = path_to_index + ".dict";
+  char* dict_ptr = nullptr;
+  struct stat dict_statbuf{};
+  if (int dict_fd = open(path_to_dict.c_str(), O_RDONLY); dict_fd >= 0)
   {
-    work_perworker = packed.size() / search_worker;
+    if (fstat(dict_fd, &dict_statbuf) == 0)
+    {
+      dict_ptr = static_cast<char*>(mmap(nullptr, dict_statbuf.st_size, PROT_READ, MAP_SHARED, dict_fd, 0));
+      if (dict_ptr == MAP_FAILED)
+        dict_ptr = nullptr;
+    }
+    close(dict_fd);
   }
-  std::vector<std::thread> workers;
-  workers.resize(search_worker);
+
   std::vector<std::vector<std::string>> result;
   result.resize(tokens.size());
 
-  auto load_and_search = [search_title, &result, &add_mtx, &tokens](std::string_view raw_index)
+  // For -k, a min-heap of the best books so far for each token.
+  std::mutex add_mtx;
+  std::vector<std::vector<RankedBook>> ranked;
+  ranked.resize(tokens.size());
+  auto ranked_cmp = [](auto&& a, auto&& b) { return a.freq > b.freq; };
+  auto threshold = [&](size_t i)
+  {
+    std::lock_guard l(add_mtx);
+    return ranked[i].size() == top_k ? ranked[i].front().freq : 0;
+  };
+  auto add_ranked = [&](size_t i, size_t segment, const std::vector<txtfst::ScoredBook>& books)
+  {
+    std::lock_guard l(add_mtx);
+    for (auto&& book : books)
+    {
+      ranked[i].emplace_back(book.freq, segment, book.idx);
+      std::ranges::push_heap(ranked[i], ranked_cmp);
+      if (ranked[i].size() > top_k)
+      {
+        std::ranges::pop_heap(ranked[i], ranked_cmp);
+        ranked[i].pop_back();
+      }
+    }
+  };
+
+  bool use_dict = false;
+  if (dict_ptr != nullptr && query == Query::Each && !substring)
+  {
+    txtfst::DictionaryView dict({dict_ptr, static_cast<size_t>(dict_statbuf.st_size)});
+    if (dict.segments != packed.size() || dict.index_size != indexdata.size())
+    {
+      std::println(std::cerr, "WARNING: Ignored stale dictionary '{}'.", path_to_dict);
+    }
+    else
+    {
+      use_dict = true;
+      for (size_t i = 0; i < tokens.size(); ++i)
+      {
+        for (auto&& location : dict.find(tokens[i]))
+        {
+          txtfst::IndexView index(packed[location.segment]);
+          if (top_k != 0)
+          {
+            add_ranked(i, location.segment, search_title
+                                              ? index.top_title_entry(location.entry, top_k, threshold(i))
+                                              : index.top_content_entry(location.entry, top_k, threshold(i)));
+            continue;
+          }
+          auto a = search_title
+                     ? index.search_title_entry(location.entry)
+                     : index.search_content_entry(location.entry);
+          result[i].insert(result[i].end(), std::make_move_iterator(a.begin()),
+                           std::make_move_iterator(a.end()));
+        }
+      }
+    }
+  }
+  if (dict_ptr != nullptr)
+    munmap(dict_ptr, dict_statbuf.st_size);
+
+  // With more than one thread, segments are handed out largest first, each
+  // to the thread with the fewest bytes so far, so that the threads finish
+  // at about the same time however uneven the segments are. The last list
+  // is the main thread's.
+  std::vector<std::vector<size_t> > work(search_worker + 1);
+  if (!use_dict)
+  {
+    std::vector<size_t> order(packed.size());
+    std::iota(order.begin(), order.end(), 0);
+    if (search_worker != 0)
+      std::ranges::stable_sort(order, std::greater{}, [&packed](size_t i) { return packed[i].size(); });
+    std::vector<size_t> load(work.size(), 0);
+    for (auto i : order)
+    {
+      auto least = std::ranges::min_element(load) - load.begin();
+      work[least].emplace_back(i);
+      load[least] += packed[i].size();
+    }
+  }
+  std::vector<std::thread> workers;
+
+  std::vector<std::string> matched;
+
+  auto load_and_search = [&](size_t segment)
   {
-    txtfst::IndexView index(raw_index);
+    txtfst::IndexView index(packed[segment]);
+    if (query != Query::Each)
+    {
+      auto book_set = [search_title, &index](const std::string& token)
+      {
+        return search_title ? index.title_set(token) : index.content_set(token);
+      };
+      auto books = book_set(tokens[0]);
+      for (size_t i = 1; i < tokens.size(); ++i)
+      {
+        if (query == Query::And)
+        {
+          if (books.empty()) break;
+          books &= book_set(tokens[i]);
+        }
+        else
+          books |= book_set(tokens[i]);
+      }
+      for (auto&& token : excluded)
+      {
+        if (books.empty()) break;
+        books -= book_set(token);
+      }
+      std::vector<std::string> a;
+      books.for_each([&a, &index](size_t idx) { a.emplace_back(index.book_path(idx)); });
+      add_mtx.lock();
+      matched.insert(matched.end(), std::make_move_iterator(a.begin()), std::make_move_iterator(a.end()));
+      add_mtx.unlock();
+      return;
+    }
     for (size_t i = 0; i < tokens.size(); ++i)
     {
-      if (search_title)
+      if (substring)
+      {
+        auto a = search_title
+                   ? index.search_title_substring(tokens[i])
+                   : index.search_content_substring(tokens[i]);
+        add_mtx.lock();
+        result[i].insert(result[i].end(), std::make_move_iterator(a.begin()),
+                      std::make_move_iterator(a.end()));
+        add_mtx.unlock();
+      }
+      else if (top_k != 0)
+      {
+        add_ranked(i, segment, search_title
+                                 ? index.top_title(tokens[i], top_k, threshold(i))
+                                 : index.top_content(tokens[i], top_k, threshold(i)));
+      }
+      else if (search_title)
       {
         auto a = index.search_title(tokens[i]);
         add_mtx.lock();
@@ -149,33 +399,40 @@ int main(int argc, char** argv)
     }
   };
 
-  if(work_perworker != 0)
+  for (size_t i = 0; i < search_worker; ++i)
   {
-    for (size_t i = 0; i < search_worker; ++i)
+    if (work[i].empty())
+      continue;
+    workers.emplace_back([&work, i, &load_and_search]
     {
-      workers[i] = std::thread{
-        [work_perworker, i, &packed, &load_and_search]
-        {
-          for (size_t j = i * work_perworker; j < (i + 1) * work_perworker; ++j)
-            load_and_search(packed[j]);
-        }
-      };
-    }
+      for (auto segment : work[i])
+        load_and_search(segment);
+    });
   }
+  for (auto segment : work.back())
+    load_and_search(segment);
+  for (auto&& worker : workers)
+    worker.join();
 
-  for (size_t i = search_worker * work_perworker; i < packed.size(); ++i)
-    load_and_search(packed[i]);
-
-  if(work_perworker != 0)
+  if (query != Query::Each)
   {
-    for (size_t i = 0; i < search_worker; ++i)
+    if (!matched.empty())
     {
-      if (workers[i].joinable())
-        workers[i].join();
+      std::println(std::cout, "Result:");
+      for (auto&& r : matched)
+        std::println(std::cout, "{}", r);
     }
+    else
+      std::println(std::cout, "No book found.");
+  }
+  for (size_t i = 0; i < tokens.size() && top_k != 0; ++i)
+  {
+    std::ranges::sort_heap(ranked[i], ranked_cmp);
+    for (auto&& book : ranked[i])
+      result[i].emplace_back(txtfst::IndexView{packed[book.segment]}.book_path(book.idx));
   }
 
-  for (size_t i = 0; i < tokens.size(); ++i)
+  for (size_t i = 0; i < tokens.size() && query == Query::Each; ++i)
   {
     if (!result[i].empty())
     {
@@ -0,0 +1,180 @@
+#include <iostream>
+#include <unordered_map>
+#include <map>
+#include <bit>
+
+#include "txtfst/index.h"
+#include "txtfst/manifest.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+void print_usage(char** argv)
+{
+  std::println(std::cerr, "Usage: {} [path to index] [options]", argv[0]);
+  std::println(std::cerr, "Options:");
+  std::println(std::cerr, "   -t, --top [num]        Show the top n tokens by document frequency, defaults to be 10");
+}
+
+// Buckets are 0, 1, 2-3, 4-7, ...
+size_t bucket(size_t n)
+{
+  return std::bit_width(n);
+}
+
+std::string bucket_name(size_t b)
+{
+  if (b <= 1)
+    return std::to_string(b);
+  return std::format("{}-{}", size_t{1} << (b - 1), (size_t{1} << b) - 1);
+}
+
+void print_histogram(const std::string& title, const std::map<size_t, size_t>& histogram)
+{
+  std::println(std::cout, "{}:", title);
+  for (auto&& [b, count] : histogram)
+    std::println(std::cout, "  {:>12} {:>12}", bucket_name(b), count);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    print_usage(argv);
+    return -1;
+  }
+
+  std::string path_to_index = argv[1];
+  size_t top = 10;
+
+  for (size_t i = 2; i < argc; ++i)
+  {
+    std::string option = argv[i];
+    if (option == "-t" || option == "--top")
+    {
+      if (i + 1 >= argc)
+      {
+        std::println(std::cerr, "Expected a number after '{}'.", option);
+        return -1;
+      }
+      try
+      {
+        top = std::stoul(argv[i + 1]);
+      }
+      catch (...)
+      {
+        std::println(std::cerr, "Expected a number after '{}', found '{}'.", option, argv[i + 1]);
+        return -1;
+      }
+      ++i;
+    }
+    else
+    {
+      std::println(std::cerr, "Unknown option '{}'.", option);
+      print_usage(argv);
+      return -1;
+    }
+  }
+
+  int fd = open(path_to_index.c_str(), O_RDONLY);
+  struct stat statbuf{};
+  if (fd < 0 || fstat(fd, &statbuf) != 0)
+  {
+    std::println(std::cerr, "Failed to open index.");
+    return -1;
+  }
+  auto ptr = static_cast<char*>(mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0));
+  close(fd);
+  if (ptr == MAP_FAILED)
+  {
+    std::println(std::cerr, "Failed to map index.");
+    return -1;
+  }
+  std::string_view indexdata{ptr, static_cast<size_t>(statbuf.st_size)};
+
+  auto segments = txtfst::read_manifest(indexdata);
+  auto packed = txtfst::segment_data(indexdata, segments);
+
+  // The bytes of an arc that only exist for alignment. The sections are
+  // packed back to back, so this is the only padding in a segment.
+  using Arc = txtfst::State<uint32_t>::Arc;
+  constexpr size_t arc_padding = sizeof(Arc) - sizeof(Arc::label) - sizeof(Arc::id) - sizeof(Arc::output);
+
+  txtfst::SectionSizes total;
+  size_t total_books = 0, total_terms = 0, total_states = 0, total_arcs = 0;
+  std::map<size_t, size_t> state_histogram;
+  std::map<size_t, size_t> fanout_histogram;
+  std::map<size_t, size_t> posting_histogram;
+  std::unordered_map<std::string, size_t> document_freq;
+
+  std::println(std::cout, "Index '{}': {} segments, {} bytes.", path_to_index, packed.size(), indexdata.size());
+  // Everything after the last segment is the manifest and its footer.
+  if (size_t end = segments.empty() ? 0 : segments.back().offset + segments.back().size; end < indexdata.size())
+    std::println(std::cout, "Manifest: {} bytes.", indexdata.size() - end);
+  else
+    std::println(std::cout, "Manifest: none, the segments were found by their sizes.");
+  std::println(std::cout, "{:>8} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>12} {:>12} {:>10} {:>10} {:>10}",
+               "Segment", "Books", "Tokens", "States", "Header", "Filter", "Names", "Paths", "Entries", "FST",
+               "Sets", "Grams", "Meta");
+  for (size_t i = 0; i < packed.size(); ++i)
+  {
+    txtfst::IndexView index(packed[i]);
+    auto& s = index.section_sizes;
+    size_t terms = index.entries_view.jump_table_size;
+    size_t states = index.fst_view.jump_table_size;
+    std::println(std::cout, "{:>8} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>12} {:>12} {:>10} {:>10} {:>10}",
+                 i, index.books(), terms, states, s.header, s.filter, s.names, s.paths, s.entries, s.fst, s.sets,
+                 s.grams, s.meta);
+
+    total.header += s.header;
+    total.filter += s.filter;
+    total.names += s.names;
+    total.paths += s.paths;
+    total.entries += s.entries;
+    total.fst += s.fst;
+    total.sets += s.sets;
+    total.grams += s.grams;
+    total.meta += s.meta;
+    total_books += index.books();
+    total_terms += terms;
+    total_states += states;
+    ++state_histogram[bucket(states)];
+
+    for (size_t j = 0; j < states; ++j)
+    {
+      auto fanout = index.fst_view.state(j).trans.size();
+      total_arcs += fanout;
+      ++fanout_histogram[bucket(fanout)];
+    }
+    index.fst_view.for_each([&](const std::string& token, uint32_t entry)
+    {
+      auto len = index.postings(entry).size();
+      ++posting_histogram[bucket(len)];
+      document_freq[token] += len;
+    });
+  }
+  std::println(std::cout, "{:>8} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>12} {:>12} {:>10} {:>10} {:>10}",
+               "Total", total_books, total_terms, total_states, total.header, total.filter, total.names,
+               total.paths, total.entries, total.fst, total.sets, total.grams, total.meta);
+  std::println(std::cout, "Distinct tokens: {}, FST arcs: {}.", document_freq.size(), total_arcs);
+
+  print_histogram("FST states (per segment)", state_histogram);
+  print_histogram("Arc fan-out", fanout_histogram);
+  print_histogram("Posting length (per segment)", posting_histogram);
+
+  std::vector<std::pair<std::string, size_t> > sorted(document_freq.begin(), document_freq.end());
+  auto n = (std::min)(top, sorted.size());
+  std::ranges::partial_sort(sorted, sorted.begin() + static_cast<ptrdiff_t>(n), std::greater{},
+                            [](auto&& r) { return r.second; });
+  std::println(std::cout, "Top {} tokens by document frequency:", n);
+  for (size_t i = 0; i < n; ++i)
+    std::println(std::cout, "  {:>12} {:>12}", sorted[i].first, sorted[i].second);
+
+  std::println(std::cout, "Wasted padding: {} bytes, {} in each of the {} FST arcs.", total_arcs * arc_padding,
+               arc_padding, total_arcs);
+
+  munmap(ptr, statbuf.st_size);
+  return 0;
+}
@@ -8,6 +8,7 @@ void print_usage(char** argv)
   std::println(std::cerr, "Options:");
   std::println(std::cerr, "   -n, --no-check            Enable unchecked tokenizer", argv[0]);
   std::println(std::cerr, "   -f, --filiter [num]       Drop tokens whose length < [num]", argv[0]);
+  std::println(std::cerr, "   -w, --stopwords [path]    Drop the words listed in [path], or common English words with 'default'", argv[0]);
 }
 
 int main(int argc, char** argv)
@@ -20,6 +21,8 @@ int main(int argc, char** argv)
 
   bool use_checked_tokenizer = true;
   int filter = -1;
+  txtfst::Stopwords stopwords;
+  bool use_stopwords = false;
 
   std::string path = argv[1];
 
@@ -54,6 +57,21 @@ int main(int argc, char** argv)
       {
         use_checked_tokenizer = false;
       }
+      else if (options[i] == "-w" || options[i] == "--stopwords")
+      {
+        if (i + 1 >= options.size())
+        {
+          std::println(std::cerr, "Expected a path or 'default' after '{}'.", options[i]);
+          return -1;
+        }
+        if (options[i + 1] != "default" && !stopwords.load(options[i + 1]))
+        {
+          std::println(std::cerr, "Failed to read stopwords from '{}'.", options[i + 1]);
+          return -1;
+        }
+        use_stopwords = true;
+        ++i;
+      }
       else
       {
         std::println(std::cerr, "Unknown option '{}'.", options[i]);
@@ -62,8 +80,8 @@ int main(int argc, char** argv)
       }
     }
   }
-  auto [title, content, errcnt]
-      = txtfst::tokenize_book(path, filter, use_checked_tokenizer);
+  [[maybe_unused]] auto [title, content, errcnt, hash]
+      = txtfst::tokenize_book(path, filter, use_checked_tokenizer, use_stopwords ? &stopwords : nullptr);
 
   std::println(std::cout, "'{}': ", path);
   std::print(std::cout, "    Title: ");